@@ -0,0 +1,23 @@
+# Fails if the given objects call any of the soft-float helpers of libgcc,
+# run with -DNM=<nm> -DOBJECTS=<objects separated by ;>
+
+execute_process(
+  COMMAND ${NM} -u ${OBJECTS}
+  OUTPUT_VARIABLE symbols
+  RESULT_VARIABLE result
+)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "Could not list the symbols of ${OBJECTS}")
+endif()
+
+# the generic helpers (__addsf3, __fixsfsi, __floatsisf, ...)
+# and their ARM EABI names (__aeabi_fadd, __aeabi_f2iz, __aeabi_i2f, ...)
+set(pattern "__(add|sub|mul|div|neg|cmp|unord|eq|ne|lt|le|gt|ge)[sd]f[23]")
+set(pattern "${pattern}|__fix(uns)?[sd]f[sd]i|__float(un)?[sd]i[sd]f|__extendsfdf2|__truncdfsf2")
+set(pattern "${pattern}|__aeabi_[fd][a-z0-9]+|__aeabi_u?[il]2[fd]")
+string(REGEX MATCHALL "${pattern}" found "${symbols}")
+if(found)
+  list(REMOVE_DUPLICATES found)
+  string(REPLACE ";" ", " found "${found}")
+  message(FATAL_ERROR "The fixed point simulation uses soft-float helpers: ${found}")
+endif()
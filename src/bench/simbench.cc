@@ -0,0 +1,425 @@
+// Headless benchmark of the simulation: runs FruitSim through a few
+// scripted scenarios with both scalar types and prints the time a step
+// takes, without SDL. The check scenario fails the run if the
+// simulation gets any of simchecks.hh wrong.
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../common/sim.hh"
+#include "../common/rsqrt.hh"
+#include "../native/simchecks.hh"
+#include "../native/workers.hh"
+
+namespace {
+  inline uint64_t nowNanos() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return static_cast<uint64_t>(t.tv_sec) * 1000000000ull + t.tv_nsec;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  const bool haveCycles = true;
+#else
+  /// The cycle counters of the other targets can't be read from user space
+  const bool haveCycles = false;
+#endif
+
+  /// Time stamp counter ticks, or 0 where there is none to read
+  inline uint64_t nowCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  /// The step times of a scenario, kept separately for each range of fruit counts
+  class StepTimes {
+    static const int bucketSize = 128;
+    std::vector<std::vector<uint32_t>> buckets;
+    const char *name;
+#ifdef SIM_STATS
+    uint64_t numSteps;
+    uint64_t pairsTested, pairsOverlapping, iterations, clamped;
+    float deepest;
+#endif
+
+    static void printPercentiles(std::vector<uint32_t> &times) {
+      std::sort(times.begin(), times.end());
+      uint64_t sum = 0;
+      for (size_t i = 0; i < times.size(); ++i) {
+        sum += times[i];
+      }
+      size_t n = times.size();
+      std::cout << std::setw(8) << n <<
+          std::setw(11) << sum / n <<
+          std::setw(11) << times[n / 2] <<
+          std::setw(11) << times[n * 9 / 10] <<
+          std::setw(11) << times[n * 99 / 100] <<
+          std::setw(11) << times[n - 1] << std::endl;
+    }
+  public:
+#ifdef SIM_STATS
+    StepTimes(const char *name): name(name), numSteps(0), pairsTested(0), pairsOverlapping(0),
+        iterations(0), clamped(0), deepest(0) { }
+#else
+    StepTimes(const char *name): name(name) { }
+#endif
+
+    /// Runs a step of the simulation and notes how long it took
+    template <typename S> void step(FruitSimT<S> &sim, uint32_t frame) {
+      int numFruits = sim.getNumFruits();
+      uint64_t start = nowNanos();
+      sim.simulate(frame, frame);
+      uint64_t elapsed = nowNanos() - start;
+      size_t bucket = numFruits / bucketSize;
+      if (bucket >= buckets.size()) buckets.resize(bucket + 1);
+      buckets[bucket].push_back(elapsed > 0xffffffffu ? 0xffffffffu : elapsed);
+#ifdef SIM_STATS
+      const SimStatsT<S> &stats(sim.getStats());
+      ++numSteps;
+      pairsTested += stats.pairsTested;
+      pairsOverlapping += stats.pairsOverlapping;
+      iterations += stats.iterations;
+      clamped += stats.clamped;
+      if (deepest < static_cast<float>(stats.maxPenetration)) deepest = static_cast<float>(stats.maxPenetration);
+#endif
+    }
+
+    void print() {
+      for (size_t b = 0; b < buckets.size(); ++b) {
+        if (buckets[b].empty()) continue;
+        int low = b * bucketSize;
+        int high = low + bucketSize - 1;
+        std::cout << std::left << std::setw(16) << name << std::right <<
+            std::setw(5) << low << "-" << std::left << std::setw(5) << high << std::right;
+        printPercentiles(buckets[b]);
+      }
+#ifdef SIM_STATS
+      if (numSteps) {
+        std::cout << std::left << std::setw(16) << name << std::right << " per step: " <<
+            pairsTested / numSteps << " pairs tested, " << pairsOverlapping / numSteps << " overlapping, " <<
+            static_cast<float>(iterations) / numSteps << " iterations, " << clamped / numSteps <<
+            " clamped, deepest overlap " << deepest << std::endl;
+      }
+#endif
+    }
+  };
+
+  template <typename S> void startGame(FruitSimT<S> &sim) {
+    sim.init(7);
+    sim.newGame();
+    // the same settings as the game
+    sim.setGravity(S(simcheck::gameGravity));
+    sim.setSolverIterations(4, 24);
+    sim.setPenetrationTolerance(S(0.05f));
+  }
+
+  /// Drops random planets at the pace of a game, until the pile tops out
+  template <typename S> void randomDrops(FruitSimT<S> &sim, StepTimes &times) {
+    startGame(sim);
+    Random rand(11);
+    uint32_t frame = 0;
+    for (int i = 0; i < 1000; ++i) {
+      S x = sim.getWorldWidth() * S(rand.fraction());
+      sim.addFruit(x, S(0), rand(sim.getNumRandomRadii()), i);
+      for (int j = 0; j < 24; ++j) {
+        times.step(sim, ++frame);
+      }
+      if (sim.findGroundedOutside(frame) >= 0) break;
+    }
+  }
+
+  /// A checkerboard pile of the two smallest planets, so no two planets
+  /// of the same kind touch at the start, stacking above the world if
+  /// there are too many of them
+  template <typename S> void buildPile(FruitSimT<S> &sim, int count) {
+    startGame(sim);
+    S r = sim.getRadius(1);
+    S spacing = sim.getRadius(0) + r;
+    int columns = scalarFloor((sim.getWorldWidth() - r * 2) / spacing) + 1;
+    for (int i = 0; i < count; ++i) {
+      int row = i / columns;
+      int column = i % columns;
+      S x = spacing * column + r;
+      S y = sim.getWorldHeight() - r - spacing * row;
+      sim.addFruit(x, y, (row + column) & 1, i);
+    }
+  }
+
+  /// Lets a fresh pile settle
+  template <typename S> void densePile(FruitSimT<S> &sim, int count, StepTimes &times) {
+    buildPile(sim, count);
+    for (uint32_t frame = 1; frame <= 512; ++frame) {
+      times.step(sim, frame);
+    }
+  }
+
+  /// Columns of planets growing downwards, so a single small planet
+  /// dropped on top sets off a merge all the way down
+  template <typename S> void chainMerges(FruitSimT<S> &sim, StepTimes &times) {
+    const int numColumns = 3;
+    const int chainLength = 6;
+    uint32_t frame = 0;
+    for (int round = 0; round < 32; ++round) {
+      startGame(sim);
+      for (int c = 0; c < numColumns; ++c) {
+        S x = sim.getWorldWidth() * (2 * c + 1) / (2 * numColumns);
+        S y = sim.getWorldHeight();
+        for (int k = chainLength - 1; k >= 0; --k) {
+          S r = sim.getRadius(k);
+          y -= r;
+          sim.addFruit(x, y, k, round * 16 + k);
+          y -= r;
+        }
+        sim.addFruit(x, y - sim.getRadius(0) * 2, 0, round);
+      }
+      for (int j = 0; j < 256; ++j) {
+        times.step(sim, ++frame);
+      }
+    }
+  }
+
+  /// Steps a batch of games played side by side, dropping a planet in
+  /// each of them every 24 steps, and returns the world steps per second
+  template <typename S> double batchThroughput(int numWorlds, int numThreads, bool compact) {
+    const int numSteps = 960;
+    std::vector<FruitSimT<S>*> worlds(numWorlds);
+    std::vector<Random> rands;
+    for (int i = 0; i < numWorlds; ++i) {
+      worlds[i] = new FruitSimT<S>();
+      startGame(*worlds[i]);
+      worlds[i]->setCompact(compact);
+      rands.push_back(Random(i + 11));
+    }
+    AutoDelete<WorkerPool> pool = new WorkerPool(numThreads, true);
+    FruitSimBatchT<S> batch;
+    batch.setWorlds(worlds.data(), numWorlds);
+    batch.setJobs(pool);
+    uint64_t elapsed = 0;
+    for (uint32_t frame = 1; frame <= numSteps; ++frame) {
+      if (frame % 24 == 0) {
+        for (int i = 0; i < numWorlds; ++i) {
+          S x = worlds[i]->getWorldWidth() * S(rands[i].fraction());
+          worlds[i]->addFruit(x, S(0), rands[i](worlds[i]->getNumRandomRadii()), frame);
+        }
+      }
+      uint64_t start = nowNanos();
+      batch.simulate(frame, frame);
+      elapsed += nowNanos() - start;
+    }
+    for (int i = 0; i < numWorlds; ++i) {
+      delete worlds[i];
+    }
+    return numWorlds * static_cast<double>(numSteps) * 1e9 / elapsed;
+  }
+
+  volatile uint32_t sink;
+
+  template <typename S> S fromRaw(uint32_t raw);
+
+  template <> inline Fixed fromRaw<Fixed>(uint32_t raw) {
+    return Fixed::fromRaw(raw);
+  }
+
+  template <> inline float fromRaw<float>(uint32_t raw) {
+    return raw / 65536.0f;
+  }
+
+  inline double toDouble(Fixed f) {
+    return f.f / 65536.0;
+  }
+
+  inline double toDouble(float f) {
+    return f;
+  }
+
+  /// Times the kernel on the scalar type, and finds its relative error
+  /// over the positive 16.16 values, every 127th of them
+  template <typename S, typename Rsqrt> void rsqrtKernel(const char *name) {
+    double maxError = 0;
+    double sumError = 0;
+    uint64_t numSamples = 0;
+    for (uint32_t raw = 1; raw < 0x80000000u; raw += 127) {
+      S x = fromRaw<S>(raw);
+      double exact = 1 / sqrt(toDouble(x));
+      double error = fabs(toDouble(Rsqrt::get(x)) - exact) / exact;
+      if (error > maxError) maxError = error;
+      sumError += error;
+      ++numSamples;
+    }
+    const int numInputs = 4096;
+    const int numRounds = 2048;
+    std::vector<S> inputs;
+    for (int i = 0; i < numInputs; ++i) {
+      inputs.push_back(fromRaw<S>(1 + i * (0x7fffffffu / numInputs)));
+    }
+    // the results are summed up, so the calls can't be left out
+    uint32_t sum = 0;
+    uint64_t start = nowNanos();
+    uint64_t startCycles = nowCycles();
+    for (int r = 0; r < numRounds; ++r) {
+      for (int i = 0; i < numInputs; ++i) {
+        S y = Rsqrt::get(inputs[i]);
+        uint32_t bits;
+        memcpy(&bits, &y, sizeof(bits));
+        sum += bits;
+      }
+    }
+    uint64_t cycles = nowCycles() - startCycles;
+    uint64_t elapsed = nowNanos() - start;
+    double numCalls = static_cast<double>(numInputs) * numRounds;
+    std::cout << std::left << std::setw(22) << name << std::right << std::fixed <<
+        std::setprecision(2) << std::setw(9) << elapsed / numCalls << std::setw(13);
+    if (haveCycles) {
+      std::cout << cycles / numCalls;
+    } else {
+      std::cout << "n/a";
+    }
+    std::cout << std::scientific << std::setprecision(2) << std::setw(13) << maxError <<
+        std::setw(13) << sumError / numSamples << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+    sink = sum;
+  }
+
+  template <typename S> void rsqrtKernels() {
+    std::cout << "rsqrt kernel            ns/call  cycles/call    max error   mean error" << std::endl;
+    rsqrtKernel<S, rsqrt::BitHack<0>>("bit hack");
+    rsqrtKernel<S, rsqrt::BitHack<1>>("bit hack, 1 step (*)");
+    rsqrtKernel<S, rsqrt::BitHack<2>>("bit hack, 2 steps");
+    rsqrtKernel<S, rsqrt::Table<0>>("table");
+    rsqrtKernel<S, rsqrt::Table<1>>("table, 1 step");
+    rsqrtKernel<S, rsqrt::Table<2>>("table, 2 steps");
+    rsqrtKernel<S, rsqrt::Hardware<0>>("hardware");
+    rsqrtKernel<S, rsqrt::Hardware<1>>("hardware, 1 step");
+    rsqrtKernel<S, rsqrt::Hardware<2>>("hardware, 2 steps");
+  }
+
+  /// Prints whether the check passed, returns 1 if it failed
+  int report(const char *name, bool passed) {
+    std::cout << std::left << std::setw(32) << name << std::right << (passed ? "ok" : "FAILED") << std::endl;
+    return passed ? 0 : 1;
+  }
+
+  /// Runs the checks of simchecks.hh, returns the number of them failed
+  template <typename S> int runChecks() {
+    int numFailed = 0;
+    numFailed += report("ids follow the fruits", simcheck::idsFollowFruits<S>());
+    numFailed += report("contact kernel, all pairs", simcheck::contactKernelMatches<S>(false));
+    numFailed += report("contact kernel, grid", simcheck::contactKernelMatches<S>(true));
+    numFailed += report("far planets stay apart", simcheck::farPlanetsStayApart<S>());
+    numFailed += report("shrunk world pushes in", simcheck::shrunkWorldPushesIn<S>());
+    numFailed += report("snapshots repeat", simcheck::snapshotsRepeat<S>());
+    const int threadCounts[] = { 2, 4 };
+    for (size_t t = 0; t < sizeof(threadCounts) / sizeof(*threadCounts); ++t) {
+      WorkerPool workers(threadCounts[t]);
+      char name[32];
+      snprintf(name, sizeof(name), "solver on %d threads repeats", threadCounts[t]);
+      numFailed += report(name, simcheck::solverThreadsRepeat<S>(&workers));
+    }
+    return numFailed;
+  }
+
+  const char * const scenarioNames[] = { "drops", "pile", "chain", "cap", "stress", "batch", "rsqrt", "check", nullptr };
+  const char * const scalarNames[] = { "fixed", "float", nullptr };
+
+  /// Whether the name is on the command line, or none of its group is
+  bool isSelected(const char *name, const char * const *group, int argc, char **argv) {
+    bool anyOfGroup = false;
+    for (int i = 1; i < argc; ++i) {
+      if (!strcmp(argv[i], name)) return true;
+      for (const char * const *g = group; *g; ++g) {
+        if (!strcmp(argv[i], *g)) anyOfGroup = true;
+      }
+    }
+    return !anyOfGroup;
+  }
+
+  /// Returns the number of checks failed
+  template <typename S> int runScenarios(const char *scalarName, int argc, char **argv) {
+    FruitSimT<S> *sim = new FruitSimT<S>();
+    std::cout << "simbench: " << scalarName << ", contact kernel " << FruitSimT<S>::getContactKernelName() << std::endl;
+    const char * const stepScenarios[] = { "drops", "pile", "chain", "cap", "stress" };
+    for (size_t i = 0; i < sizeof(stepScenarios) / sizeof(*stepScenarios); ++i) {
+      if (!isSelected(stepScenarios[i], scenarioNames, argc, argv)) continue;
+      std::cout << "scenario          fruits       steps    mean ns     p50 ns     p90 ns     p99 ns     max ns" << std::endl;
+      break;
+    }
+    if (isSelected("drops", scenarioNames, argc, argv)) {
+      StepTimes times("random drops");
+      randomDrops(*sim, times);
+      times.print();
+    }
+    if (isSelected("pile", scenarioNames, argc, argv)) {
+      StepTimes times("dense pile");
+      const int counts[] = { 128, 256, 512 };
+      for (size_t i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+        densePile(*sim, counts[i], times);
+      }
+      times.print();
+    }
+    if (isSelected("chain", scenarioNames, argc, argv)) {
+      StepTimes times("chain merges");
+      chainMerges(*sim, times);
+      times.print();
+    }
+    if (isSelected("cap", scenarioNames, argc, argv)) {
+      StepTimes times("full cap");
+      densePile(*sim, sim->getMaxNumFruits(), times);
+      times.print();
+    }
+    if (isSelected("stress", scenarioNames, argc, argv)) {
+      StepTimes times("stress world");
+      FruitSimT<S> stress(16384);
+      stress.setWorldSize(S(128), S(96));
+      const int counts[] = { 4096, 16384 };
+      for (size_t i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+        densePile(stress, counts[i], times);
+      }
+      times.print();
+    }
+    if (isSelected("batch", scenarioNames, argc, argv)) {
+      const int numWorlds = 64;
+      int numCores = WorkerPool::getNumCores();
+      std::cout << "batch of " << numWorlds << " worlds (" << numCores << " cores), world steps/s" << std::endl;
+      for (int threads = 1; threads <= 8; threads *= 2) {
+        std::cout << std::setw(3) << threads << " threads: " << std::fixed << std::setprecision(0) <<
+            batchThroughput<S>(numWorlds, threads, false) << ", compact " <<
+            batchThroughput<S>(numWorlds, threads, true) << std::endl;
+        if (threads >= numCores) break;
+      }
+    }
+    if (isSelected("rsqrt", scenarioNames, argc, argv)) {
+      rsqrtKernels<S>();
+    }
+    delete sim;
+    int numFailed = 0;
+    if (isSelected("check", scenarioNames, argc, argv)) {
+      numFailed = runChecks<S>();
+    }
+    return numFailed;
+  }
+}
+
+int main(int argc, char **argv) {
+  int numFailed = 0;
+  if (isSelected("fixed", scalarNames, argc, argv)) {
+    numFailed += runScenarios<Fixed>("fixed 16.16", argc, argv);
+  }
+  if (isSelected("float", scalarNames, argc, argv)) {
+    numFailed += runScenarios<float>("float", argc, argv);
+  }
+  // a failed check fails the run, so a build can be gated on it
+  return numFailed ? 1 : 0;
+}
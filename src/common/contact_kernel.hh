@@ -0,0 +1,237 @@
+#pragma once
+
+#include "sim.hh"
+
+// The overlap test of one fruit against a group of candidates,
+// the instruction set is picked at compile time.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CONTACT_KERNEL_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONTACT_KERNEL_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONTACT_KERNEL_NEON
+#endif
+
+namespace contact {
+
+#if defined(CONTACT_KERNEL_AVX2)
+  const int numLanes = 8;
+  const char * const kernelName = "AVX2";
+#elif defined(CONTACT_KERNEL_SSE2)
+  const int numLanes = 4;
+  const char * const kernelName = "SSE2";
+#elif defined(CONTACT_KERNEL_NEON)
+  const int numLanes = 4;
+  const char * const kernelName = "NEON";
+#else
+  const int numLanes = 1;
+  const char * const kernelName = "scalar";
+#endif
+
+  /// Below this many candidates testing them one by one is faster
+  const int minCandidates = numLanes < 4 ? numLanes + 1 : 4;
+
+  /// Floats may be contracted differently in the scalar test, so the
+  /// vector test errs on the side of reporting a contact
+  const float margin = 1.0f / 65536.0f;
+
+  /// The lane and vector types of a scalar type, Fixed is tested
+  /// as 16.16 integers
+  template <typename S> struct Lanes;
+
+#if defined(CONTACT_KERNEL_AVX2)
+  template <> struct Lanes<Fixed> {
+    typedef int32_t Lane;
+    typedef __m256i Vector;
+  };
+
+  template <> struct Lanes<float> {
+    typedef float Lane;
+    typedef __m256 Vector;
+  };
+
+  /// The square of 8 16.16 numbers, truncated just like Fixed does
+  inline __m256i fixedSquare(__m256i v) {
+    __m256i a = _mm256_abs_epi32(v);
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(a, a), 16);
+    __m256i oddA = _mm256_srli_epi64(a, 32);
+    __m256i odd = _mm256_slli_epi64(_mm256_srli_epi64(_mm256_mul_epu32(oddA, oddA), 16), 32);
+    return _mm256_blend_epi32(even, odd, 0xAA);
+  }
+
+  inline __m256i gatherLanes(const int32_t *base, const int *i) {
+    return _mm256_setr_epi32(base[i[0]], base[i[1]], base[i[2]], base[i[3]],
+        base[i[4]], base[i[5]], base[i[6]], base[i[7]]);
+  }
+
+  inline uint32_t testLanes(int32_t ax, int32_t ay, int32_t ar, __m256i bx, __m256i by, __m256i br) {
+    __m256i dx = _mm256_sub_epi32(bx, _mm256_set1_epi32(ax));
+    __m256i dy = _mm256_sub_epi32(by, _mm256_set1_epi32(ay));
+    __m256i d2 = _mm256_add_epi32(fixedSquare(dx), fixedSquare(dy));
+    __m256i rsum = _mm256_add_epi32(br, _mm256_set1_epi32(ar));
+    __m256i overlap = _mm256_cmpgt_epi32(fixedSquare(rsum), d2);
+    return _mm256_movemask_ps(_mm256_castsi256_ps(overlap));
+  }
+
+  inline __m256 gatherLanes(const float *base, const int *i) {
+    return _mm256_setr_ps(base[i[0]], base[i[1]], base[i[2]], base[i[3]],
+        base[i[4]], base[i[5]], base[i[6]], base[i[7]]);
+  }
+
+  inline uint32_t testLanes(float ax, float ay, float ar, __m256 bx, __m256 by, __m256 br) {
+    __m256 dx = _mm256_sub_ps(bx, _mm256_set1_ps(ax));
+    __m256 dy = _mm256_sub_ps(by, _mm256_set1_ps(ay));
+    __m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+    __m256 rsum = _mm256_add_ps(br, _mm256_set1_ps(ar));
+    __m256 rs = _mm256_mul_ps(rsum, rsum);
+    __m256 limit = _mm256_add_ps(rs, _mm256_mul_ps(rs, _mm256_set1_ps(margin)));
+    return _mm256_movemask_ps(_mm256_cmp_ps(d2, limit, _CMP_LT_OQ));
+  }
+#elif defined(CONTACT_KERNEL_SSE2)
+  template <> struct Lanes<Fixed> {
+    typedef int32_t Lane;
+    typedef __m128i Vector;
+  };
+
+  template <> struct Lanes<float> {
+    typedef float Lane;
+    typedef __m128 Vector;
+  };
+
+  /// The square of 4 16.16 numbers, truncated just like Fixed does
+  inline __m128i fixedSquare(__m128i v) {
+    __m128i sign = _mm_srai_epi32(v, 31);
+    __m128i a = _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+    __m128i even = _mm_srli_epi64(_mm_mul_epu32(a, a), 16);
+    __m128i oddA = _mm_srli_epi64(a, 32);
+    __m128i odd = _mm_slli_epi64(_mm_srli_epi64(_mm_mul_epu32(oddA, oddA), 16), 32);
+    return _mm_or_si128(_mm_and_si128(even, _mm_set_epi32(0, -1, 0, -1)), odd);
+  }
+
+  inline __m128i gatherLanes(const int32_t *base, const int *i) {
+    return _mm_setr_epi32(base[i[0]], base[i[1]], base[i[2]], base[i[3]]);
+  }
+
+  inline uint32_t testLanes(int32_t ax, int32_t ay, int32_t ar, __m128i bx, __m128i by, __m128i br) {
+    __m128i dx = _mm_sub_epi32(bx, _mm_set1_epi32(ax));
+    __m128i dy = _mm_sub_epi32(by, _mm_set1_epi32(ay));
+    __m128i d2 = _mm_add_epi32(fixedSquare(dx), fixedSquare(dy));
+    __m128i rsum = _mm_add_epi32(br, _mm_set1_epi32(ar));
+    __m128i overlap = _mm_cmplt_epi32(d2, fixedSquare(rsum));
+    return _mm_movemask_ps(_mm_castsi128_ps(overlap));
+  }
+
+  inline __m128 gatherLanes(const float *base, const int *i) {
+    return _mm_setr_ps(base[i[0]], base[i[1]], base[i[2]], base[i[3]]);
+  }
+
+  inline uint32_t testLanes(float ax, float ay, float ar, __m128 bx, __m128 by, __m128 br) {
+    __m128 dx = _mm_sub_ps(bx, _mm_set1_ps(ax));
+    __m128 dy = _mm_sub_ps(by, _mm_set1_ps(ay));
+    __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+    __m128 rsum = _mm_add_ps(br, _mm_set1_ps(ar));
+    __m128 rs = _mm_mul_ps(rsum, rsum);
+    __m128 limit = _mm_add_ps(rs, _mm_mul_ps(rs, _mm_set1_ps(margin)));
+    return _mm_movemask_ps(_mm_cmplt_ps(d2, limit));
+  }
+#elif defined(CONTACT_KERNEL_NEON)
+  template <> struct Lanes<Fixed> {
+    typedef int32_t Lane;
+    typedef int32x4_t Vector;
+  };
+
+  template <> struct Lanes<float> {
+    typedef float Lane;
+    typedef float32x4_t Vector;
+  };
+
+  inline uint32_t laneBits(uint32x4_t mask) {
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+    uint32x4_t b = vandq_u32(mask, vld1q_u32(bits));
+    uint32x2_t sum = vadd_u32(vget_low_u32(b), vget_high_u32(b));
+    return vget_lane_u32(vpadd_u32(sum, sum), 0);
+  }
+
+  /// The square of 4 16.16 numbers, truncated just like Fixed does
+  inline int32x4_t fixedSquare(int32x4_t v) {
+    int64x2_t lo = vmull_s32(vget_low_s32(v), vget_low_s32(v));
+    int64x2_t hi = vmull_s32(vget_high_s32(v), vget_high_s32(v));
+    return vcombine_s32(vshrn_n_s64(lo, 16), vshrn_n_s64(hi, 16));
+  }
+
+  inline int32x4_t gatherLanes(const int32_t *base, const int *i) {
+    int32x4_t v = vdupq_n_s32(base[i[0]]);
+    v = vsetq_lane_s32(base[i[1]], v, 1);
+    v = vsetq_lane_s32(base[i[2]], v, 2);
+    return vsetq_lane_s32(base[i[3]], v, 3);
+  }
+
+  inline uint32_t testLanes(int32_t ax, int32_t ay, int32_t ar, int32x4_t bx, int32x4_t by, int32x4_t br) {
+    int32x4_t dx = vsubq_s32(bx, vdupq_n_s32(ax));
+    int32x4_t dy = vsubq_s32(by, vdupq_n_s32(ay));
+    int32x4_t d2 = vaddq_s32(fixedSquare(dx), fixedSquare(dy));
+    int32x4_t rsum = vaddq_s32(br, vdupq_n_s32(ar));
+    return laneBits(vcltq_s32(d2, fixedSquare(rsum)));
+  }
+
+  inline float32x4_t gatherLanes(const float *base, const int *i) {
+    float32x4_t v = vdupq_n_f32(base[i[0]]);
+    v = vsetq_lane_f32(base[i[1]], v, 1);
+    v = vsetq_lane_f32(base[i[2]], v, 2);
+    return vsetq_lane_f32(base[i[3]], v, 3);
+  }
+
+  inline uint32_t testLanes(float ax, float ay, float ar, float32x4_t bx, float32x4_t by, float32x4_t br) {
+    float32x4_t dx = vsubq_f32(bx, vdupq_n_f32(ax));
+    float32x4_t dy = vsubq_f32(by, vdupq_n_f32(ay));
+    float32x4_t d2 = vaddq_f32(vmulq_f32(dx, dx), vmulq_f32(dy, dy));
+    float32x4_t rsum = vaddq_f32(br, vdupq_n_f32(ar));
+    float32x4_t rs = vmulq_f32(rsum, rsum);
+    float32x4_t limit = vaddq_f32(rs, vmulq_f32(rs, vdupq_n_f32(margin)));
+    return laneBits(vcltq_f32(d2, limit));
+  }
+#endif
+
+#if defined(CONTACT_KERNEL_AVX2) || defined(CONTACT_KERNEL_SSE2) || defined(CONTACT_KERNEL_NEON)
+  template <typename S> inline const typename Lanes<S>::Lane* lanes(const S *s) {
+    return reinterpret_cast<const typename Lanes<S>::Lane*>(s);
+  }
+
+  template <typename S> inline typename Lanes<S>::Lane lane(const S &s) {
+    return *lanes(&s);
+  }
+
+  /// Up to numLanes candidates to test a fruit against
+  template <typename S> struct Candidates {
+    typename Lanes<S>::Vector bx, by, br;
+    int n;
+
+    /// Zeroed, so a group is never read before its first gather
+    inline Candidates(): bx(), by(), br(), n(0) { }
+
+    /// Loads the count (at most numLanes) candidates
+    inline void gather(const FruitStoreT<S> &s, const int *candidates, int count) {
+      int indices[numLanes];
+      n = count;
+      for (int i = 0; i < numLanes; ++i) {
+        // the unused lanes repeat the first one, they are masked out
+        indices[i] = candidates[i < n ? i : 0];
+      }
+      bx = gatherLanes(lanes(s.xs), indices);
+      by = gatherLanes(lanes(s.ys), indices);
+      br = gatherLanes(lanes(s.rs), indices);
+    }
+
+    /// Returns a bit for each candidate that may overlap fruit a.
+    /// It never misses an overlap, the scalar test has the final
+    /// say for the reported ones.
+    inline uint32_t overlapMask(const FruitStoreT<S> &s, int a) const {
+      return testLanes(lane(s.xs[a]), lane(s.ys[a]), lane(s.rs[a]), bx, by, br) & ((1u << n) - 1);
+    }
+  };
+#endif
+
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+// Reciprocal square root kernels for both scalar types. A kernel is an
+// estimate refined by a number of Newton steps, FruitSimT takes one as a
+// template parameter, see docs/rsqrt.md for the bit hacked estimates
+
+#include "sim.hh"
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace rsqrt {
+  inline Fixed newton(Fixed x, Fixed y) {
+    return y * (3 - x*y*y) >> 1;
+  }
+
+  inline float newton(float x, float y) {
+    return y * (1.5F - (x * 0.5F) * y * y);
+  }
+
+  /// The log2 approximations from docs/rsqrt.md
+  struct BitHackEstimate {
+    static inline Fixed estimate(Fixed f) {
+      uint32_t n = f.f;
+      if (!n) return f;
+      int bits = 32 - __builtin_clz(n);
+      int newBits = 16-((bits-16) >> 1);
+      uint32_t y = ((n-(1 << (bits-1)))>>1)+(((bits&1)^1) << (bits-1));
+      y ^= (1 << (bits - 1)) - 1;
+      if (newBits > bits) {
+        y <<= newBits - bits;
+      } else if (newBits < bits) {
+        y >>= bits - newBits;
+      }
+      y += (1 << newBits);
+      uint32_t sub = 0x4dbfab13 >> (31-newBits);
+      if (y >= sub) y -= sub;
+      return Fixed::fromRaw(y);
+    }
+
+    static inline float estimate(float number) {
+      int32_t i;
+      float y;
+
+      // the bits are copied, reading a float through an int pointer breaks strict aliasing
+      __builtin_memcpy(&i, &number, sizeof(i));
+      i  = 0x5f3759df - ( i >> 1 );               // what in the world?
+      __builtin_memcpy(&y, &i, sizeof(y));
+      return y;
+    }
+  };
+
+  namespace {
+    /// 2^15 / sqrt((j + 0.5) / 16) for j from 16 to 63
+    const uint16_t rsqrtTable[48] = {
+      32268, 31332, 30474, 29682, 28949, 28268, 27632, 27038,
+      26481, 25956, 25462, 24994, 24552, 24132, 23733, 23354,
+      22992, 22646, 22315, 21999, 21695, 21404, 21124, 20855,
+      20596, 20346, 20106, 19873, 19649, 19431, 19221, 19018,
+      18821, 18630, 18444, 18264, 18090, 17920, 17755, 17594,
+      17438, 17285, 17137, 16992, 16851, 16714, 16579, 16448,
+    };
+  }
+
+  /// Looks up the mantissa scaled to [1, 4) in 48 steps, so the exponent
+  /// halves exactly, about 1.5% off before the Newton steps
+  struct TableEstimate {
+    static inline Fixed estimate(Fixed f) {
+      uint32_t n = f.f;
+      if (!n) return f;
+      int bits = 32 - __builtin_clz(n);
+      // even, so that n >> shift is in [16, 64)
+      int shift = (bits - 5) & ~1;
+      uint32_t j = shift >= 0 ? n >> shift : n << -shift;
+      int scale = 7 - shift / 2;
+      uint32_t y = rsqrtTable[j - 16];
+      return Fixed::fromRaw(scale >= 0 ? y << scale : y >> -scale);
+    }
+
+    static inline float estimate(float number) {
+      if (!(number > 0)) return 0;
+      uint32_t i;
+      __builtin_memcpy(&i, &number, sizeof(i));
+      int exponent = static_cast<int>(i >> 23) - 127;
+      int even = exponent & ~1;
+      uint32_t mantissa = i & 0x7fffff;
+      uint32_t j = exponent & 1 ? 32 + (mantissa >> 18) : 16 + (mantissa >> 19);
+      uint32_t scaleBits = static_cast<uint32_t>(127 - 15 - even / 2) << 23;
+      float scale;
+      __builtin_memcpy(&scale, &scaleBits, sizeof(scale));
+      return rsqrtTable[j - 16] * scale;
+    }
+  };
+
+  /// rsqrtss on SSE and vrsqrte on NEON, about 12 and 8 bits precise,
+  /// the bit hack without either of them; Fixed goes through float,
+  /// so it has no place on a target without an FPU
+  struct HardwareEstimate {
+    static inline float estimate(float number) {
+#if defined(__SSE__)
+      return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(number)));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+      return vrsqrtes_f32(number);
+#elif defined(__ARM_NEON)
+      return vget_lane_f32(vrsqrte_f32(vdup_n_f32(number)), 0);
+#else
+      return BitHackEstimate::estimate(number);
+#endif
+    }
+
+    static inline Fixed estimate(Fixed f) {
+#if defined(__SSE__) || defined(__ARM_NEON)
+      if (!f.f) return f;
+      return Fixed(estimate(f.toFloat()));
+#else
+      return BitHackEstimate::estimate(f);
+#endif
+    }
+  };
+
+  template <typename Estimate, int newtonSteps> struct Kernel {
+    template <typename S> static inline S get(S x) {
+      S y = Estimate::estimate(x);
+      for (int i = 0; i < newtonSteps; ++i) y = newton(x, y);
+      return y;
+    }
+  };
+
+  template <int newtonSteps> using BitHack = Kernel<BitHackEstimate, newtonSteps>;
+  template <int newtonSteps> using Table = Kernel<TableEstimate, newtonSteps>;
+  template <int newtonSteps> using Hardware = Kernel<HardwareEstimate, newtonSteps>;
+}
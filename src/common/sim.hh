@@ -2,7 +2,6 @@
 
 #include <stdint.h>
 
-#ifdef FIXED
 struct Fixed {
   int32_t f;  // 16.16 fixed point number
 
@@ -11,8 +10,9 @@ struct Fixed {
 
   // Constructors
   Fixed() {}                        // Default constructor
-  Fixed(int val) : f(val << FRACTIONAL_BITS) {}  // Constructor from int
-  Fixed(float val) : f(static_cast<int32_t>(val * (1 << FRACTIONAL_BITS))) {}  // Constructor from float
+  // Both are constexpr, so constants are converted at compile time
+  constexpr Fixed(int val) : f(val * (1 << FRACTIONAL_BITS)) {}  // Constructor from int
+  constexpr Fixed(float val) : f(static_cast<int32_t>(val * (1 << FRACTIONAL_BITS))) {}  // Constructor from float
 
   // Static helper to create Fixed from raw value
   static Fixed fromRaw(int32_t raw) {
@@ -174,9 +174,11 @@ struct Fixed {
   }
 };
 
+/// The simulation is a template on the scalar type, both Fixed and float
+/// are compiled in. This is the one the build picks for the game.
+#ifdef FIXED
 typedef Fixed Scalar;
 #else
-
 typedef float Scalar;
 #endif
 
@@ -184,7 +186,7 @@ static uint64_t nextSeed(uint64_t seed) {
   return (seed * 0x5DEECE66DLL + 0xBLL) & ((1LL << 48) - 1);
 }
 
-static float seedToFloat(uint64_t seed) {
+static inline float seedToFloat(uint64_t seed) {
   return (seed & 0xffffff) / static_cast<float>(0xffffff);
 }
 
@@ -204,17 +206,45 @@ public:
   float fraction() {
     return seedToFloat(seed = nextSeed(seed));
   }
+
+  /// Same as fraction, but without float for Fixed
+  template <typename S = Scalar> S scalarFraction();
 };
 
-inline Scalar scalarAbs(const Scalar &s) {
-  return s < Scalar(0) ? -s : s;
+template <> inline Fixed Random::scalarFraction<Fixed>() {
+  return Fixed::fromRaw(((seed = nextSeed(seed)) & 0xffffff) >> 8);
 }
 
-struct Point {
+template <> inline float Random::scalarFraction<float>() {
+  return fraction();
+}
+
+inline Fixed scalarAbs(const Fixed &s) {
+  return s < Fixed(0) ? -s : s;
+}
+
+inline float scalarAbs(float s) {
+  return s < 0 ? -s : s;
+}
+
+/// Rounds towards negative infinity
+inline int scalarFloor(const Fixed &s) {
+  return s.toInt();
+}
+
+inline int scalarFloor(float s) {
+  int i = static_cast<int>(s);
+  return s < i ? i - 1 : i;
+}
+
+template <typename S> struct PointT {
+  typedef S Scalar;
+  typedef PointT<S> Point;
+
   Scalar x, y;
 
-  inline Point() { }
-  inline Point(Scalar x, Scalar y): x(x), y(y) { }
+  inline PointT() { }
+  inline PointT(Scalar x, Scalar y): x(x), y(y) { }
 
   inline void rotate90() {
     Scalar save = x;
@@ -265,10 +295,30 @@ struct Point {
   }
 };
 
-struct Fruit {
-  enum FruitFlags {
+typedef PointT<Scalar> Point;
+
+/// The flags of a fruit, the same for every scalar type
+struct FruitFlags {
+  enum {
     touched = 1, sensor = 2, deletable = 4,
+    /// At rest, the solver skips it until something wakes it up
+    asleep = 8,
+    /// Touched something this step that isn't at rest
+    restless = 16,
+    /// Was held up by the ground when it fell asleep
+    grounded = 32,
+    /// Just woke up, the sleepers resting on it have to wake up too
+    woken = 64,
+    /// The number of steps the fruit has been still for
+    stillUnit = 0x100, stillMask = 0xff00,
+    /// The id of the fruit, it keeps it while the records are moved around
+    idUnit = 0x10000, idMask = 0x7fff0000,
   };
+};
+
+template <typename S> struct FruitT: FruitFlags {
+  typedef S Scalar;
+  typedef PointT<S> Point;
 
   Point pos;
   Point lastPos;
@@ -278,36 +328,548 @@ struct Fruit {
   uint32_t flags;
   uint32_t bottomTouchFrame;
 
-  void move(Scalar gravity);
-  void roll();
-  int keepDistance(Fruit &other, uint32_t frameIndex);
-  void constrainInside(uint32_t frameIndex);
-  bool touches(const Fruit &other) const;
+  bool touches(const FruitT &other) const;
+
+  /// Stays the same from addFruit until the fruit is merged, and is
+  /// below the capacity, the fruits alive at the same time all differ
+  inline int id() const {
+    return (flags & idMask) / idUnit;
+  }
 };
 
-const int fruitCap = 1024;
+typedef FruitT<Scalar> Fruit;
+
+/// The capacity of a simulation unless it is given another one
+const int defaultFruitCap = 1024;
+/// The indices are 16 bit signed in places, and so are the ids
+const int maxFruitCap = 32768;
+/// In world units, the broadphase grid has a byte for a cell coordinate
+const int maxWorldSize = 240;
 const int numRadii = 11;
 
-class FruitSim {
-  Fruit fruits[fruitCap];
+static_assert(maxFruitCap <= FruitFlags::idMask / FruitFlags::idUnit + 1, "the ids don't fit in the flags");
+
+enum class FruitLayout { arrayOfStructs, structOfArrays };
+
+/// Structure of arrays copy of the fruits for the solver, so the pair
+/// tests only pull the position, radius and kind of the other fruit
+/// into the cache. It is loaded from and stored back to the Fruit
+/// records around each step, those remain the public view.
+template <typename S> struct FruitStoreT {
+  typedef S Scalar;
+  typedef FruitT<S> Fruit;
+
+  Scalar *xs;
+  Scalar *ys;
+  Scalar *rs;
+  uint32_t *rIndices;
+  uint32_t *flagBits;
+  Scalar *lastXs;
+  Scalar *lastYs;
+  Scalar *relXs;
+  Scalar *relYs;
+  uint32_t *rotations;
+  uint32_t *bottomTouchFrames;
+
+  inline FruitStoreT(): xs(nullptr), ys(nullptr), rs(nullptr), rIndices(nullptr), flagBits(nullptr),
+      lastXs(nullptr), lastYs(nullptr), relXs(nullptr), relYs(nullptr), rotations(nullptr), bottomTouchFrames(nullptr) { }
+  inline ~FruitStoreT() {
+    release();
+  }
+  FruitStoreT(const FruitStoreT&) = delete;
+  FruitStoreT& operator=(const FruitStoreT&) = delete;
+
+  void setCapacity(int capacity);
+  void release();
+
+  /// Without rolling the rotation and the pushes it is summed from
+  /// are left out, the renderer is the only one looking at them
+  void load(const Fruit *fruits, int numFruits, bool rolling);
+  void store(Fruit *fruits, int numFruits, bool rolling) const;
+  void copy(int to, int from);
+
+  inline Scalar& x(int i) { return xs[i]; }
+  inline Scalar& y(int i) { return ys[i]; }
+  inline Scalar r(int i) const { return rs[i]; }
+  inline void setRadius(int i, Scalar r) { rs[i] = r; }
+  inline uint32_t& rIndex(int i) { return rIndices[i]; }
+  inline uint32_t& flags(int i) { return flagBits[i]; }
+  inline Scalar& lastX(int i) { return lastXs[i]; }
+  inline Scalar& lastY(int i) { return lastYs[i]; }
+  inline Scalar& relX(int i) { return relXs[i]; }
+  inline Scalar& relY(int i) { return relYs[i]; }
+  inline uint32_t& rotation(int i) { return rotations[i]; }
+  inline uint32_t& bottomTouchFrame(int i) { return bottomTouchFrames[i]; }
+};
+
+/// Uniform grid broadphase with one world unit sized cells.
+/// Each fruit is registered in every cell its bounding box touches,
+/// and a pair is only reported by the cell where the bounding boxes
+/// start to overlap, so no pair is visited twice.
+class BroadphaseGrid {
+public:
+  /// A world less tall than this many rows leaves the rest above it
+  static const int minCellsY = 64;
+  /// The cell ranges of the fruits are bytes
+  static const int maxCells = 255;
+  static const int entriesPerFruit = 16;
+private:
+  int cellsX, cellsY;
+  int rowsAbove;
+  int cellCap;
+  int entryCap;
+  uint32_t *cellStart;
+  uint16_t *entries;
+  /// Cell range of each fruit: x0, y0, x1, y1
+  uint8_t (*bounds)[4];
+
+  inline int clampCell(int c, int n) const {
+    return c < 0 ? 0 : c >= n ? n - 1 : c;
+  }
+public:
+  inline BroadphaseGrid(): cellsX(0), cellsY(0), rowsAbove(0), cellCap(0), entryCap(0),
+      cellStart(nullptr), entries(nullptr), bounds(nullptr) { }
+  ~BroadphaseGrid();
+  BroadphaseGrid(const BroadphaseGrid&) = delete;
+  BroadphaseGrid& operator=(const BroadphaseGrid&) = delete;
+
+  void setCapacity(int capacity);
+  template <typename S> void setup(S worldWidth, S worldHeight, S maxRadius);
+  /// Returns false if the fruits don't fit in the entry buffer
+  template <typename Layout> bool build(Layout &fruits, int numFruits);
+  /// Calls the visitor with the fruits entered into the cells the box
+  /// touches, a fruit in more than one of them comes up more than once
+  template <typename S, typename Visitor> void visit(S x0, S y0, S x1, S y1, Visitor visitor) const;
+
+  inline int getNumCells() const {
+    return cellsX * cellsY;
+  }
+
+  inline int getNumColumns() const {
+    return cellsX;
+  }
+
+  inline int getNumRows() const {
+    return cellsY;
+  }
+
+  /// The first and last row the fruit was entered into
+  inline int topRow(int i) const {
+    return bounds[i][1];
+  }
+
+  inline int bottomRow(int i) const {
+    return bounds[i][3];
+  }
+
+  inline const uint16_t* cellBegin(int cell) const {
+    return entries + cellStart[cell];
+  }
+
+  inline const uint16_t* cellEnd(int cell) const {
+    return entries + cellStart[cell + 1];
+  }
+
+  /// Whether the pair should be handled in the given cell
+  inline bool owns(int cell, int a, int b) const {
+    int x = bounds[a][0] > bounds[b][0] ? bounds[a][0] : bounds[b][0];
+    int y = bounds[a][1] > bounds[b][1] ? bounds[a][1] : bounds[b][1];
+    return x + y * cellsX == cell;
+  }
+};
+
+/// Buckets the fruit centres into unit cells for the queries between
+/// the steps. Every cell has a list of its fruits, and after a step only
+/// the fruits that ended up in another cell are moved.
+template <typename S> class FruitIndexT {
+public:
+  typedef S Scalar;
+  typedef FruitT<S> Fruit;
+private:
+  int cellsX, cellsY;
+  int rowsAbove;
+  int numIndexed;
+  int cellCap;
+  /// The largest radius indexed, the queries look this far around
+  Scalar reach;
+  int16_t *head;
+  int16_t *next;
+  int16_t *prev;
+  /// Can be more than 16 bits, 255 by 255 cells at most
+  int32_t *cellOf;
+
+  inline int clampCell(int c, int n) const {
+    return c < 0 ? 0 : c >= n ? n - 1 : c;
+  }
+
+  inline int cellAt(Scalar x, Scalar y) const {
+    return clampCell(scalarFloor(x), cellsX) + clampCell(scalarFloor(y) + rowsAbove, cellsY) * cellsX;
+  }
+
+  void link(int i, int cell);
+  void unlink(int i);
+public:
+  inline FruitIndexT(): cellsX(0), cellsY(0), rowsAbove(0), numIndexed(0), cellCap(0), reach(0),
+      head(nullptr), next(nullptr), prev(nullptr), cellOf(nullptr) { }
+  ~FruitIndexT();
+  FruitIndexT(const FruitIndexT&) = delete;
+  FruitIndexT& operator=(const FruitIndexT&) = delete;
+
+  void setCapacity(int capacity);
+  /// Takes the same cells as BroadphaseGrid, it starts out empty
+  void setup(Scalar worldWidth, Scalar worldHeight, Scalar maxRadius);
+  void clear();
+  /// Brings the index up to date with the fruits after they moved
+  void update(const Fruit *fruits, int numFruits);
+  /// Adds a fruit appended after the indexed ones
+  void append(const Fruit &f);
+  /// Drops the fruits from the given index on
+  void truncate(int numFruits);
+  /// Calls the visitor with every fruit that may overlap the box,
+  /// until it returns true, in which case so does visit
+  template <typename Visitor> bool visit(Scalar x0, Scalar y0, Scalar x1, Scalar y1, Visitor visitor) const;
+};
+
+/// The pushes between the touching fruits in the last step, kept by the
+/// ids of the pairs, so the next step can start out from them. A pair
+/// takes a slot in the row of its lower id and a link back to it in the
+/// row of its higher id; a row is only written while the pairs of its
+/// fruit are solved, so the solver bands never share one.
+template <typename S> class ContactCacheT {
+public:
+  typedef S Scalar;
+  typedef PointT<S> Point;
+
+  static const int slotsPerFruit = 8;
+  /// A large planet is the higher id of more pairs than it has slots
+  static const int linksPerFruit = 16;
+  static const uint16_t noContact = 0xffff;
+
+  struct Slot {
+    /// The higher id of the pair
+    uint16_t other;
+    /// The kinds of the pair, the push is dropped if either one changes
+    uint8_t kinds;
+    /// Pushed in this step
+    uint8_t touched;
+    /// The push from the lower id to the higher one
+    Point push;
+  };
+private:
+  int numIds;
+  Slot (*slots)[slotsPerFruit];
+  /// The lower ids that may have a slot for the pair with this one, a
+  /// link stays behind when the pair is dropped from the other side
+  uint16_t (*links)[linksPerFruit];
+
+  inline bool hasPair(int low, int high) const {
+    for (int k = 0; k < slotsPerFruit; ++k) {
+      if (slots[low][k].other == high) return true;
+    }
+    return false;
+  }
+public:
+  inline ContactCacheT(): numIds(0), slots(nullptr), links(nullptr) { }
+  inline ~ContactCacheT() {
+    delete[] slots;
+    delete[] links;
+  }
+  ContactCacheT(const ContactCacheT&) = delete;
+  ContactCacheT& operator=(const ContactCacheT&) = delete;
+
+  /// Makes room for the ids below capacity and forgets every contact,
+  /// 0 frees the slots
+  void setCapacity(int capacity);
+  void clear();
+  /// Adds to the push of the pair, a fruit full of contacts drops the rest
+  void add(int idA, int kindA, int idB, int kindB, Point push);
+  /// Forgets the contacts of a fruit, only looking at its own rows
+  void release(int id);
+  /// Forgets the pairs in the row of the id that didn't touch in the step
+  void age(int id);
+  /// Takes over the contacts of the other cache, along with its capacity
+  void copyFrom(const ContactCacheT &other);
+
+  inline Slot* row(int id) {
+    return slots[id];
+  }
+
+  static inline uint8_t packKinds(int kindLow, int kindHigh) {
+    return kindLow | kindHigh << 4;
+  }
+};
+
+/// Runs batches of independent solver jobs, possibly on several threads.
+/// The simulation only needs the batch to be finished by the time run
+/// returns, the order of the jobs doesn't matter.
+class SolverJobs {
+protected:
+  ~SolverJobs() { }
+public:
+  typedef void (*Job)(void *context, int index);
+
+  virtual void run(Job job, void *context, int numJobs) = 0;
+  virtual int getNumThreads() const = 0;
+};
+
+/// Two planets of the same kind merging during a step
+template <typename S> struct MergeEventT {
+  /// The indices the two planets had in the solver pass of the merge,
+  /// a grew into the merged planet and b was removed
+  int32_t a, b;
+  /// The kind of the merged planet, numRadii if both of them disappeared
+  int32_t rIndex;
+  int32_t score;
+  PointT<S> pos;
+  /// The ids of a and b, a keeps its id unless both of them disappeared
+  int32_t idA, idB;
+};
+
+typedef MergeEventT<Scalar> MergeEvent;
+
+/// What a solver pass collects besides moving the fruits
+template <typename S> struct SolverTallyT {
+  int score;
+  MergeEventT<S> *merges;
+  int numMerges;
+  S deepest;
+  bool anyDeletable;
+#ifdef SIM_STATS
+  uint32_t pairsTested;
+  uint32_t pairsOverlapping;
+#endif
+};
+
+/// What the solver did in the last step. The counters are only kept by
+/// a build with SIM_STATS defined, otherwise they stay zero and cost nothing.
+template <typename S> struct SimStatsT {
+  /// The pairs that got the exact overlap test, the broadphase and the
+  /// vectorized test have already thrown out the rest
+  uint32_t pairsTested;
+  uint32_t pairsOverlapping;
+  uint32_t merges;
+  uint32_t iterations;
+  /// The times a fruit was pushed back inside the world
+  uint32_t clamped;
+  /// The deepest overlap in any of the iterations
+  S maxPenetration;
+
+  inline void clear() {
+    pairsTested = pairsOverlapping = merges = iterations = clamped = 0;
+    maxPenetration = 0;
+  }
+};
+
+typedef SimStatsT<Scalar> SimStats;
+
+/// Everything a simulation steps on from, the fruits, the score and the
+/// settings of the solver, saved by FruitSimT::saveSnapshot. Restoring
+/// it makes the next steps the same as the ones after saving it. Only
+/// the fruits in play are copied, and the buffer is kept for the next
+/// save, so saving each frame doesn't allocate.
+template <typename S> class FruitSnapshotT {
+  template <typename, typename> friend class FruitSimT;
+
+  FruitT<S> *fruits;
+  int bufferSize;
+  int numFruits;
+  /// The capacity of the simulation it was saved from, the ids are below it
+  int fruitCap;
+  S worldWidth;
+  S worldHeight;
+  S gravity;
+  S penetrationTolerance;
+  int score;
+  int popCount;
+  int lastPopCount;
+  int minIterations;
+  int maxIterations;
+  int reorderInterval;
+  int stepsSinceReorder;
+  bool useBroadphase;
+  bool useContactKernel;
+  bool useSleeping;
+  bool compact;
+  bool warmStarting;
+  FruitLayout layout;
+  ContactCacheT<S> contacts;
+public:
+  inline FruitSnapshotT(): fruits(nullptr), bufferSize(0), numFruits(0), fruitCap(0) { }
+  inline ~FruitSnapshotT() {
+    delete[] fruits;
+  }
+  FruitSnapshotT(const FruitSnapshotT&) = delete;
+  FruitSnapshotT& operator=(const FruitSnapshotT&) = delete;
+
+  /// Whether anything was saved in it yet
+  inline bool isEmpty() const {
+    return !fruitCap;
+  }
+
+  inline int getNumFruits() const {
+    return numFruits;
+  }
+
+  inline int getScore() const {
+    return score;
+  }
+};
+
+typedef FruitSnapshotT<Scalar> FruitSnapshot;
+
+/// What FruitSimT::predictDrop found out about a planet dropped into the world
+template <typename S> struct DropPredictionT {
+  static const int maxChain = 16;
+
+  /// Whether the planet, or the one it merged into, came to rest on the
+  /// pile or the ground within the steps
+  bool landed;
+  /// The steps it took to land, or all of them if it didn't
+  int numSteps;
+  /// Where it first came to rest, where it ended up if it didn't
+  PointT<S> landing;
+  /// The kind it had there
+  int landingKind;
+  /// The merges the planet took part in, then the ones of the planet
+  /// it merged into, in order, the ones past maxChain are only counted
+  MergeEventT<S> chain[maxChain];
+  int chainLength;
+  /// The score of every merge in the steps, not only the chain
+  int score;
+};
+
+typedef DropPredictionT<Scalar> DropPrediction;
+
+/// A range of grid rows solved by one job
+template <typename S> struct SolverBandT {
+  int rowBegin, rowEnd;
+  SolverTallyT<S> tally;
+};
+
+const int maxSolverBands = 8;
+
+namespace rsqrt {
+  struct BitHackEstimate;
+  template <typename Estimate, int newtonSteps> struct Kernel;
+}
+
+/// Rsqrt is one of the kernels in rsqrt.hh
+template <typename S, typename Rsqrt = rsqrt::Kernel<rsqrt::BitHackEstimate, 1>> class FruitSimT;
+
+template <typename S, typename Rsqrt> class FruitSimT {
+public:
+  typedef S Scalar;
+  typedef PointT<S> Point;
+  typedef FruitT<S> Fruit;
+  typedef MergeEventT<S> MergeEvent;
+private:
+  typedef SolverTallyT<S> SolverTally;
+  typedef SolverBandT<S> SolverBand;
+
+  /// Everything sized by the capacity is on the heap, so a simulation
+  /// only takes as much memory as its world needs
+  int fruitCap;
+  Fruit *fruits;
   int numFruits;
+  Scalar worldWidth;
+  Scalar worldHeight;
+  /// The cells are scaled down this much for the Z curve of a large world
+  int mortonShift;
   int popCount;
   int lastPopCount;
   Scalar gravity;
   int score;
+  bool useBroadphase;
+  bool useContactKernel;
+  bool useSleeping;
+  bool compact;
+  int numAwake;
+  int minIterations;
+  int maxIterations;
+  int lastIterations;
+  Scalar penetrationTolerance;
+  Scalar deepestOverlap;
+  FruitLayout layout;
+  BroadphaseGrid grid;
+  /// Whether the grid has to be built again before the wake ups look for
+  /// the sleepers in it, and whether the fruits fit in it the last time
+  bool gridStale;
+  bool gridFits;
+  FruitIndexT<S> spatialIndex;
+  FruitStoreT<S> store;
+  uint16_t *wakeStack;
+  SolverJobs *jobs;
+  SolverBand bands[maxSolverBands];
+  /// The band a fruit is entirely inside of, or -1 if it crosses a border
+  int8_t *fruitBand;
+  /// The band of each grid row, and whether a fruit crosses it into another
+  int8_t *rowBand;
+  bool *rowOnBorder;
+  /// Every merge removes a planet, so a step can't have more of them
+  MergeEvent *mergeEvents;
+  int numMergeEvents;
+  /// A bit for each fruit id in use
+  uint32_t *usedIds;
+  /// Room for two numbers per fruit for the passes that need them
+  uint32_t *scratch;
+  bool warmStarting;
+  ContactCacheT<S> contacts;
+  int reorderInterval;
+  int stepsSinceReorder;
+  SimStatsT<S> stats;
+
+  void allocate();
+  void release();
+  void setupWorld();
+  int allocateId();
+  void releaseId(int id);
+  /// Rebuilds usedIds from the fruits, giving a new id to the ones with
+  /// an id past the capacity or sharing one with a fruit before them
+  void assignIds();
+  void reorder();
+  SolverTally startTally();
+  template <typename Layout> void finishTally(Layout &l, const SolverTally &tally);
+  /// Calls the visitor with the sleepers that may have their centre in
+  /// the box, through the grid unless they don't fit in it
+  template <typename Layout, typename Visitor> void visitSleepers(Layout &l, Scalar x0, Scalar y0, Scalar x1, Scalar y1, Visitor visitor);
+  template <typename Layout> void wakeSupported(Layout &l, int numWoken);
+  template <typename Layout> void wakeTouched(Layout &l, int a, int b);
+  template <typename Layout> void wakeAround(Layout &l, int a);
+  template <typename Layout> void step(Layout &l, uint32_t frameIndex);
+  template <typename Layout> void warmStart(Layout &l);
+  template <typename Layout> void solveBruteForce(Layout &l, uint32_t frameIndex);
+  template <typename Layout> void solveBroadphase(Layout &l, uint32_t frameIndex);
+  template <typename Layout, typename Filter> void solveCells(Layout &l, int cellBegin, int cellEnd,
+      uint32_t frameIndex, Filter filter, SolverTally &tally, bool wakeNow);
+  template <typename Layout> void solveBands(Layout &l, uint32_t frameIndex, SolverTally &tally);
+  template <typename Layout> static void solveBand(void *context, int band);
+  template <typename Layout> void solveAwake(Layout &l, uint32_t frameIndex);
 public:
-  inline FruitSim() { }
+  explicit FruitSimT(int capacity = defaultFruitCap);
+  ~FruitSimT();
+  FruitSimT(const FruitSimT&) = delete;
+  FruitSimT& operator=(const FruitSimT&) = delete;
 
   inline int getMaxNumFruits() const {
     return fruitCap;
   }
 
+  /// Reallocates everything for at most maxFruitCap fruits and starts
+  /// a new game, the current fruits are dropped
+  void setMaxNumFruits(int capacity);
+  /// The world is at least as wide as the largest planet and at most
+  /// maxWorldSize on either side, the default is 12 by 16. The fruits
+  /// stay, the ones outside are pushed back in by the next step.
+  void setWorldSize(Scalar width, Scalar height);
+
   inline int getNumFruits() const {
     return numFruits;
   }
 
   inline void setNumFruits(int newVal) {
     numFruits = newVal;
+    assignIds();
+    spatialIndex.update(fruits, numFruits);
   }
 
   inline int getScore() const {
@@ -325,25 +887,171 @@ public:
   inline void newGame() {
     numFruits = 0;
     score = 0;
+    assignIds();
+    spatialIndex.clear();
   }
 
   Fruit* init(int worldSeed);
+  /// The broadphase grid is on by default, turning it off falls back
+  /// to testing every pair
+  inline void setBroadphaseEnabled(bool newValue) {
+    useBroadphase = newValue;
+  }
+  /// The solver works on a structure of arrays copy by default,
+  /// this allows comparing it with working on the Fruit records
+  inline void setSolverLayout(FruitLayout newValue) {
+    layout = newValue;
+  }
+  /// The vectorized overlap test is used on the structure of arrays
+  /// layout when the platform has one, the results are the same either way
+  inline void setContactKernelEnabled(bool newValue) {
+    useContactKernel = newValue;
+  }
+  /// The instruction set of the vectorized overlap test
+  static const char* getContactKernelName();
+  /// Planets that stay still for a while fall asleep and are skipped
+  /// by the solver, turning it off wakes everything up
+  void setSleepingEnabled(bool newValue);
+  /// Compact mode skips what only the renderer needs: the planets
+  /// don't roll, their rotation stays what it was when they were added.
+  /// The positions, the merges and the score are the same either way.
+  inline void setCompact(bool newValue) {
+    compact = newValue;
+  }
+  /// The number of planets that were awake during the last step
+  inline int getNumAwake() const {
+    return numAwake;
+  }
+  /// The solver stops after at least minIterations once the deepest
+  /// overlap is under the tolerance, and at most does maxIterations.
+  /// By default it always does 16.
+  inline void setSolverIterations(int newMin, int newMax) {
+    minIterations = newMin < 1 ? 1 : newMin;
+    maxIterations = newMax < minIterations ? minIterations : newMax;
+  }
+  inline void setPenetrationTolerance(Scalar newValue) {
+    penetrationTolerance = newValue;
+  }
+  /// Copies the state into the snapshot, see FruitSnapshotT
+  void saveSnapshot(FruitSnapshotT<S> &snapshot) const;
+  /// Goes back to the snapshot, possibly one saved by another simulation;
+  /// the capacity and the world size become the ones it was saved with.
+  /// The solver jobs stay, those aren't part of the state.
+  void restoreSnapshot(const FruitSnapshotT<S> &snapshot);
+  /// Adds a planet like addFruit, then does numSteps steps from frameIndex
+  /// on following it, and the planet it merged into, until it is asleep or
+  /// gone. It plays on this simulation, so it is meant for one that
+  /// was restored from a snapshot of the game. Returns false if the planet
+  /// couldn't be added.
+  bool predictDrop(Scalar x, Scalar y, unsigned radiusIndex, int seed, uint32_t frameIndex, int numSteps,
+      DropPredictionT<S> &prediction);
+  /// The number of solver iterations the last step took
+  inline int getLastIterations() const {
+    return lastIterations;
+  }
+  inline const SimStatsT<S>& getStats() const {
+    return stats;
+  }
+  /// Splits the grid solver into bands of rows that run as separate jobs,
+  /// the fruits crossing the borders are solved after them on the calling
+  /// thread. The results only depend on the number of threads, nullptr
+  /// or a single thread keeps everything on the calling thread.
+  inline void setSolverJobs(SolverJobs *newJobs) {
+    jobs = newJobs;
+  }
+  /// Each step starts by applying most of the pushes the touching pairs
+  /// got in the last one, so a pile at rest is already close to resolved
+  /// when the solver starts, and the tolerance stops it sooner. Off by
+  /// default, the steps solve every contact from nothing then.
+  void setWarmStartingEnabled(bool newValue);
+  /// Every this many steps the fruits are sorted along a Z curve over
+  /// the cells of their centres, so the neighbours are close in memory
+  /// too. 0 keeps them in the order they were added; either way the
+  /// ids stay with the fruits.
+  inline void setReorderInterval(int steps) {
+    reorderInterval = steps;
+    stepsSinceReorder = 0;
+  }
   Fruit* simulate(int frameSeed, uint32_t frameIndex);
   bool addFruit(Scalar x, Scalar y, unsigned radiusIndex, int seed);
   Fruit* previewFruit(Scalar x, Scalar y, unsigned radiusIndex, int seed);
   inline void setGravity(Scalar newValue) {
     gravity = newValue;
   }
+  /// The grounded fruit sticking out of the top of the world with the
+  /// lowest centre, or -1 if there is none or there was a merge
   int findGroundedOutside(uint32_t frameIndex);
-  Scalar getWorldWidth() const;
-  Scalar getWorldHeight() const;
+  /// The grounded fruit reaching above the line with the lowest centre, or -1
+  int findGroundedAbove(Scalar lineY, uint32_t frameIndex) const;
+  /// Stores the indices of the fruits overlapping the circle,
+  /// at most maxFound of them, but returns the number of all of them
+  int findOverlapping(Scalar x, Scalar y, Scalar r, int *found, int maxFound) const;
+  inline Scalar getWorldWidth() const {
+    return worldWidth;
+  }
+  inline Scalar getWorldHeight() const {
+    return worldHeight;
+  }
   int getNumRadii();
   int getNumRandomRadii();
   Scalar getRadius(int index);
   int getPopCount() const;
+  /// The merges of the last step in the order they were applied
+  inline const MergeEvent* getMergeEvents() const {
+    return mergeEvents;
+  }
+  inline int getNumMergeEvents() const {
+    return numMergeEvents;
+  }
   bool touchesAny(const Fruit &f) const;
 };
 
+typedef FruitSimT<Scalar> FruitSim;
+
+/// Steps a set of independent worlds together. They are split into as
+/// many even shares as the jobs have threads, and a world always belongs
+/// to the same share, so a pool that keeps giving a job to the same thread
+/// keeps every world on the same core. The worlds shouldn't use the same
+/// jobs for their own solver, a world is only ever stepped by one thread.
+template <typename S> class FruitSimBatchT {
+  FruitSimT<S> **worlds;
+  int numWorlds;
+  SolverJobs *jobs;
+  int frameSeed;
+  uint32_t frameIndex;
+
+  static void simulateShare(void *context, int share);
+public:
+  inline FruitSimBatchT(): worlds(nullptr), numWorlds(0), jobs(nullptr), frameSeed(0), frameIndex(0) { }
+
+  /// The batch only keeps the pointer, the array has to outlive it
+  inline void setWorlds(FruitSimT<S> **newWorlds, int newNumWorlds) {
+    worlds = newWorlds;
+    numWorlds = newNumWorlds;
+  }
+
+  inline int getNumWorlds() const {
+    return numWorlds;
+  }
+
+  inline FruitSimT<S>* getWorld(int index) const {
+    return worlds[index];
+  }
+
+  /// nullptr steps every world on the calling thread
+  inline void setJobs(SolverJobs *newJobs) {
+    jobs = newJobs;
+  }
+
+  /// Puts every world into compact mode or takes them out of it
+  void setCompact(bool newValue);
+  /// Does one step of every world, it returns when all of them are done
+  void simulate(int frameSeed, uint32_t frameIndex);
+};
+
+typedef FruitSimBatchT<Scalar> FruitSimBatch;
+
 #ifdef IMPLEMENT_SIM
 #include "sim.cc"
+#include "sim_float.cc"
 #endif
@@ -0,0 +1,7 @@
+#include "sim_impl.hh"
+
+template struct FruitT<float>;
+template class FruitIndexT<float>;
+template class ContactCacheT<float>;
+template class FruitSimT<float>;
+template class FruitSimBatchT<float>;
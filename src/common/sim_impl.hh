@@ -0,0 +1,1696 @@
+#pragma once
+
+// The simulation for any scalar type, sim.cc and sim_float.cc
+// instantiate it for Fixed and float
+
+#include "sim.hh"
+#include "contact_kernel.hh"
+#include "rsqrt.hh"
+
+/// Each kind is larger than the previous one by the same ratio, worked
+/// out in float at compile time, so the fixed point build has no float
+/// at run time, but still gets the same radii it always had
+constexpr float radiusAt(int i) {
+  return i ? radiusAt(i - 1) * 1.2968395546510096f : 1.0f / 3.0f;
+}
+
+const int numRandomRadii = numRadii / 2;
+
+// counts for SimStats, a build without SIM_STATS doesn't even evaluate it
+#ifdef SIM_STATS
+#define SIM_STAT(statement) do { statement; } while (0)
+#else
+#define SIM_STAT(statement) do { } while (0)
+#endif
+
+namespace {
+  /// The constants of the simulation in its scalar type. They are all
+  /// constant expressions, Fixed would convert them from float at run
+  /// time otherwise.
+  template <typename S> struct Constants {
+    /// The world of the game, setWorldSize can change it
+    static constexpr S defaultWorldSizeX = 12;
+    static constexpr S defaultWorldSizeY = 16;
+    static constexpr S radii[numRadii] = {
+      radiusAt(0), radiusAt(1), radiusAt(2), radiusAt(3), radiusAt(4), radiusAt(5),
+      radiusAt(6), radiusAt(7), radiusAt(8), radiusAt(9), radiusAt(10),
+    };
+    static constexpr S angleScale = 32768.0f / 3.141592653589793f;
+    /// Planets slower than this on both axes count as still
+    static constexpr S sleepSpeed = 1.0f / 128.0f;
+    /// Planets faster than this wake up the sleepers they touch
+    static constexpr S wakeSpeed = 1.0f / 32.0f;
+    static constexpr S defaultGravity = 0.0078125f;
+    static constexpr S half = 0.5f;
+    /// The share of the velocity kept in each step
+    static constexpr S velocityRetention = 0.999f;
+    /// Slower planets don't roll
+    static constexpr S minRollSpeedSquared = 1.0e-3f;
+    /// The rolling is integrated once after the solver; turning 15 times
+    /// as much as an iteration used to matches what the 16 iterations
+    /// added up to, the first ones saw less of the final velocity
+    static constexpr S rollRate = 15 * 1.0e-1f / 3.141592654f;
+    /// The share of the overlap resolved by a push
+    static constexpr S pushRate = 1.0f / 16.0f;
+    /// Scales a push into the rolling of the planets
+    static constexpr S spinRate = 4;
+    /// A woken planet wakes the sleepers above it up to this many radii
+    static constexpr S supportReach = 1.125f;
+    /// The share of the pushes of the last step a warm start applies
+    static constexpr S warmStartRate = 0.75f;
+  };
+
+  // the definitions the members need when they are passed by reference
+  template <typename S> constexpr S Constants<S>::defaultWorldSizeX;
+  template <typename S> constexpr S Constants<S>::defaultWorldSizeY;
+  template <typename S> constexpr S Constants<S>::radii[numRadii];
+  template <typename S> constexpr S Constants<S>::angleScale;
+  template <typename S> constexpr S Constants<S>::sleepSpeed;
+  template <typename S> constexpr S Constants<S>::wakeSpeed;
+  template <typename S> constexpr S Constants<S>::defaultGravity;
+  template <typename S> constexpr S Constants<S>::half;
+  template <typename S> constexpr S Constants<S>::velocityRetention;
+  template <typename S> constexpr S Constants<S>::minRollSpeedSquared;
+  template <typename S> constexpr S Constants<S>::rollRate;
+  template <typename S> constexpr S Constants<S>::pushRate;
+  template <typename S> constexpr S Constants<S>::spinRate;
+  template <typename S> constexpr S Constants<S>::supportReach;
+  template <typename S> constexpr S Constants<S>::warmStartRate;
+
+  inline void turn(uint32_t &rotation, Fixed angle) {
+    // whole angle units, just like converting the float sum back
+    rotation += angle.toInt();
+  }
+
+  inline void turn(uint32_t &rotation, float angle) {
+    rotation += angle;
+  }
+
+  /// Gives the solver the same access to the Fruit records
+  /// as FruitStore does to its arrays
+  template <typename S> struct FruitArrayT {
+    typedef S Scalar;
+    typedef FruitT<S> Fruit;
+
+    Fruit *fruits;
+
+    inline Scalar& x(int i) { return fruits[i].pos.x; }
+    inline Scalar& y(int i) { return fruits[i].pos.y; }
+    inline Scalar r(int i) const { return fruits[i].r; }
+    inline void setRadius(int i, Scalar r) {
+      fruits[i].r = r;
+      fruits[i].r2 = r * r;
+    }
+    inline uint32_t& rIndex(int i) { return fruits[i].rIndex; }
+    inline uint32_t& flags(int i) { return fruits[i].flags; }
+    inline Scalar& lastX(int i) { return fruits[i].lastPos.x; }
+    inline Scalar& lastY(int i) { return fruits[i].lastPos.y; }
+    inline Scalar& relX(int i) { return fruits[i].relSum.x; }
+    inline Scalar& relY(int i) { return fruits[i].relSum.y; }
+    inline uint32_t& rotation(int i) { return fruits[i].rotation; }
+    inline uint32_t& bottomTouchFrame(int i) { return fruits[i].bottomTouchFrame; }
+    inline void copy(int to, int from) { fruits[to] = fruits[from]; }
+  };
+
+  /// Tests a fruit against a group of candidates at once, layouts
+  /// without a vectorized test report every candidate
+  template <typename Layout> struct CandidateGroup {
+    int n;
+
+    inline CandidateGroup(): n(0) { }
+
+    inline void gather(Layout &, const int *, int count) {
+      n = count;
+    }
+
+    inline uint32_t overlapMask(Layout &, int) const {
+      return (1u << n) - 1;
+    }
+  };
+
+#if defined(CONTACT_KERNEL_AVX2) || defined(CONTACT_KERNEL_SSE2) || defined(CONTACT_KERNEL_NEON)
+  template <typename S> struct CandidateGroup<FruitStoreT<S>>: contact::Candidates<S> { };
+#endif
+
+  /// This many still steps lets a planet fall asleep
+  const uint32_t sleepSteps = 64;
+  /// With fewer pairs than this the awake planets are tested against
+  /// every other one instead of building the grid
+  const int maxAwakePairs = 4096;
+  /// The grid solver is only split into bands above this many planets each
+  const int minFruitsPerBand = 64;
+
+  inline uint32_t stillSteps(uint32_t flags) {
+    return (flags & FruitFlags::stillMask) / FruitFlags::stillUnit;
+  }
+
+  inline int fruitId(uint32_t flags) {
+    return (flags & FruitFlags::idMask) / FruitFlags::idUnit;
+  }
+
+  /// Spreads the bits of a byte to the even bits
+  inline uint32_t spreadBits(uint32_t v) {
+    v = (v | v << 4) & 0x0f0f;
+    v = (v | v << 2) & 0x3333;
+    return (v | v << 1) & 0x5555;
+  }
+
+  /// The position of the unit cell on a Z curve, with room for planets
+  /// stacked up to 64 units above the world, the cells of a world larger
+  /// than 256 units with that are merged by the shift
+  template <typename S> uint32_t mortonCode(const FruitT<S> &f, int shift) {
+    int cx = scalarFloor(f.pos.x) >> shift;
+    int cy = (scalarFloor(f.pos.y) + 64) >> shift;
+    cx = cx < 0 ? 0 : cx > 255 ? 255 : cx;
+    cy = cy < 0 ? 0 : cy > 255 ? 255 : cy;
+    return spreadBits(cx) | spreadBits(cy) << 1;
+  }
+
+  template <typename Layout> bool isMoving(Layout &l, int i) {
+    typedef Constants<typename Layout::Scalar> C;
+    return !(l.flags(i) & FruitFlags::asleep) &&
+        (scalarAbs(l.x(i) - l.lastX(i)) > C::wakeSpeed || scalarAbs(l.y(i) - l.lastY(i)) > C::wakeSpeed);
+  }
+
+  /// Sleepers and the planets about to fall asleep
+  inline bool isCalm(uint32_t flags) {
+    return (flags & FruitFlags::asleep) || stillSteps(flags) >= sleepSteps;
+  }
+
+  template <typename Layout> void wake(Layout &l, int i) {
+    // not moving yet, but it has to stay still for a while to sleep again
+    l.flags(i) = (l.flags(i) & ~(FruitFlags::asleep | FruitFlags::grounded | FruitFlags::stillMask)) |
+        FruitFlags::woken | FruitFlags::stillUnit;
+  }
+
+  /// Counts the still steps, and puts the planet to sleep if both
+  /// it and everything it touched stayed still for long enough
+  template <typename Layout> void settle(Layout &l, int i, uint32_t frameIndex) {
+    typedef typename Layout::Scalar Scalar;
+    typedef Constants<Scalar> C;
+    uint32_t flags = l.flags(i);
+    if (flags & FruitFlags::asleep) return;
+    Scalar speed = scalarAbs(l.x(i) - l.lastX(i));
+    Scalar speedY = scalarAbs(l.y(i) - l.lastY(i));
+    if (speed < speedY) speed = speedY;
+    if (speed < C::sleepSpeed) {
+      if (stillSteps(flags) < sleepSteps) flags += FruitFlags::stillUnit;
+    } else if (!(speed < C::wakeSpeed)) {
+      // a pile jitters a bit, that only pauses the count
+      flags &= ~FruitFlags::stillMask;
+    }
+    if (stillSteps(flags) >= sleepSteps && !(flags & FruitFlags::restless)) {
+      flags |= FruitFlags::asleep;
+      if (l.bottomTouchFrame(i) == frameIndex) flags |= FruitFlags::grounded;
+      l.lastX(i) = l.x(i);
+      l.lastY(i) = l.y(i);
+    }
+    l.flags(i) = flags;
+  }
+
+  template <typename Layout> void move(Layout &l, int i, typename Layout::Scalar gravity) {
+    typedef typename Layout::Scalar Scalar;
+    typedef Constants<Scalar> C;
+    PointT<Scalar> diff(l.x(i) - l.lastX(i), l.y(i) - l.lastY(i));
+    l.lastX(i) = l.x(i);
+    l.lastY(i) = l.y(i);
+    l.y(i) += gravity;
+    diff *= C::velocityRetention;
+    l.x(i) += diff.x;
+    l.y(i) += diff.y;
+    l.relX(i) = l.relY(i) = Scalar(0);
+    l.flags(i) &= ~(FruitFlags::touched | FruitFlags::restless);
+  }
+
+  template <typename Rsqrt, typename Layout> void roll(Layout &l, int i) {
+    typedef typename Layout::Scalar Scalar;
+    typedef Constants<Scalar> C;
+    if (l.flags(i) & FruitFlags::touched) {
+      PointT<Scalar> vel(l.x(i) - l.lastX(i), l.y(i) - l.lastY(i));
+      if (vel.lengthSquared() > C::minRollSpeedSquared) {
+        PointT<Scalar> rel(l.relX(i), l.relY(i));
+        rel.rotate90();
+
+        rel *= Rsqrt::get(rel.lengthSquared());
+        Scalar angleVel = (rel * vel) * C::rollRate;
+        turn(l.rotation(i), angleVel * C::angleScale);
+      }
+    }
+  }
+
+  /// Moves b by push scaled by the radius of a and a the other way by
+  /// the radius of b, a sleeper stays put and the other one takes it all
+  template <typename Layout> void pushApart(Layout &l, int a, int b, PointT<typename Layout::Scalar> push) {
+    typedef typename Layout::Scalar Scalar;
+    Scalar ra = l.r(a);
+    Scalar rb = l.r(b);
+    if (l.flags(a) & FruitFlags::asleep) {
+      l.x(b) += push.x * (ra + rb);
+      l.y(b) += push.y * (ra + rb);
+    } else if (l.flags(b) & FruitFlags::asleep) {
+      l.x(a) -= push.x * (ra + rb);
+      l.y(a) -= push.y * (ra + rb);
+    } else {
+      l.x(b) += push.x * ra;
+      l.y(b) += push.y * ra;
+      l.x(a) -= push.x * rb;
+      l.y(a) -= push.y * rb;
+    }
+  }
+
+  /// Pushes fruit a and b apart, or merges b into a if they are the same,
+  /// the tally keeps the largest overlap seen, and the push is added to
+  /// the contacts if there are any
+  template <typename Rsqrt, typename Layout> int keepDistance(Layout &l, int a, int b, uint32_t frameIndex,
+      SolverTallyT<typename Layout::Scalar> &tally, ContactCacheT<typename Layout::Scalar> *contacts) {
+    typedef typename Layout::Scalar Scalar;
+    typedef Constants<Scalar> C;
+    SIM_STAT(++tally.pairsTested);
+    PointT<Scalar> diff(l.x(b) - l.x(a), l.y(b) - l.y(a));
+    Scalar d2 = diff.x * diff.x + diff.y * diff.y;
+    Scalar ra = l.r(a);
+    Scalar rb = l.r(b);
+    Scalar rsum = ra + rb;
+    Scalar rs = rsum * rsum;
+    if (d2 < rs) {
+      // overlap
+      SIM_STAT(++tally.pairsOverlapping);
+      uint32_t flagsA = l.flags(a);
+      uint32_t flagsB = l.flags(b);
+      if (!isCalm(flagsB)) l.flags(a) |= FruitFlags::restless;
+      if (!isCalm(flagsA)) l.flags(b) |= FruitFlags::restless;
+      if ((flagsA & FruitFlags::asleep) && isMoving(l, b)) wake(l, a);
+      if ((flagsB & FruitFlags::asleep) && isMoving(l, a)) wake(l, b);
+      uint32_t rIndex = l.rIndex(a);
+      if (rIndex == l.rIndex(b)) {
+        int score = (rIndex + 1)*(rIndex + 2) >> 1;
+        l.flags(b) |= FruitFlags::deletable;
+        if (rIndex >= numRadii - 1) {
+          // both of them should disappear
+          l.flags(a) |= FruitFlags::deletable;
+          return score;
+        }
+        // merge them
+        l.rIndex(a) = ++rIndex;
+        l.setRadius(a, C::radii[rIndex]);
+        PointT<Scalar> pos(l.x(a) + l.x(b), l.y(a) + l.y(b));
+        pos *= C::half;
+        l.x(a) = l.lastX(a) = pos.x;
+        l.y(a) = l.lastY(a) = pos.y;
+        l.bottomTouchFrame(a) = 0;
+        if (l.flags(a) & FruitFlags::asleep) wake(l, a);
+        l.flags(a) &= ~FruitFlags::stillMask;
+        return score;
+      } else {
+        // nudge them
+        Scalar dr = Rsqrt::get(d2);
+        // d2 = d^2 (distance squared)
+        // dr = 1/sqrt(d2)
+        // d = d2*dr = (d2 / sqrt(d2) = sqrt(d2))
+        Scalar depth = ra + rb - d2 * dr;
+        if (tally.deepest < depth) tally.deepest = depth;
+        Scalar factor = depth * C::pushRate / rsum;
+        diff *= factor;
+        pushApart(l, a, b, diff);
+        if (contacts) contacts->add(fruitId(l.flags(a)), l.rIndex(a), fruitId(l.flags(b)), l.rIndex(b), diff);
+
+        // we aren't using diff for anything else, so adjust it
+        // to alter the rotation vector
+        diff *= C::spinRate;
+        l.relX(a) += diff.x;
+        l.relY(a) += diff.y;
+        l.flags(a) |= FruitFlags::touched;
+        l.relX(b) -= diff.x;
+        l.relY(b) -= diff.y;
+        l.flags(b) |= FruitFlags::touched;
+        if (l.bottomTouchFrame(a) == frameIndex && diff.y < -scalarAbs(diff.x)/2) {
+          l.bottomTouchFrame(b) = frameIndex;
+        } else if (l.bottomTouchFrame(b) == frameIndex) {
+          l.bottomTouchFrame(a) = frameIndex;
+        }
+      }
+    }
+    return 0;
+  }
+
+  /// Notes a merge keepDistance(l, a, b) has just done
+  template <typename Layout> void recordMerge(Layout &l, int a, int b, int score,
+      SolverTallyT<typename Layout::Scalar> &tally) {
+    typedef typename Layout::Scalar Scalar;
+    typedef Constants<Scalar> C;
+    MergeEventT<Scalar> &e(tally.merges[tally.numMerges++]);
+    e.a = a;
+    e.b = b;
+    e.idA = fruitId(l.flags(a));
+    e.idB = fruitId(l.flags(b));
+    e.score = score;
+    if (l.flags(a) & FruitFlags::deletable) {
+      e.rIndex = numRadii;
+      e.pos = PointT<Scalar>((l.x(a) + l.x(b)) * C::half, (l.y(a) + l.y(b)) * C::half);
+    } else {
+      e.rIndex = l.rIndex(a);
+      e.pos = PointT<Scalar>(l.x(a), l.y(a));
+    }
+    tally.score += score;
+    tally.anyDeletable = true;
+  }
+
+  /// Returns whether the fruit was outside
+  template <typename Layout> bool constrainInside(Layout &l, int i, uint32_t frameIndex,
+      typename Layout::Scalar worldWidth, typename Layout::Scalar worldHeight) {
+    typedef typename Layout::Scalar Scalar;
+    Scalar r = l.r(i);
+    bool outside = false;
+    if (l.x(i) < r) {
+      l.x(i) = r;
+      l.relX(i) += r;
+      l.flags(i) |= FruitFlags::touched;
+      outside = true;
+    }
+    if (l.x(i) > worldWidth - r) {
+      l.x(i) = worldWidth - r;
+      l.relX(i) += -r;
+      l.flags(i) |= FruitFlags::touched;
+      outside = true;
+    }
+    // there is no top, but to keep things sane, we don't
+    // let objects past -1024
+    if (l.y(i) < Scalar(-1024)) {
+      l.y(i) = Scalar(-1024);
+      // we also trim the velocity if needed: do not go too fast down
+      if (l.lastY(i) < Scalar(-1024-512)) l.lastY(i) = Scalar(-1024-512);
+      // break the speed
+      if (l.lastY(i) > Scalar(-512)) l.lastY(i) = Scalar(-1024);
+      outside = true;
+    }
+    if (l.y(i) > worldHeight - r) {
+      l.y(i) = worldHeight - r;
+      l.relY(i) += r;
+      l.flags(i) |= FruitFlags::touched;
+      l.bottomTouchFrame(i) = frameIndex;
+      outside = true;
+    }
+    return outside;
+  }
+}
+
+template <typename S> bool FruitT<S>::touches(const FruitT &other) const {
+  Point diff = other.pos - pos;
+  Scalar d2 = diff.x * diff.x + diff.y * diff.y;
+  Scalar rsum = r + other.r;
+  Scalar rs = rsum * rsum;
+  return d2 < rs;
+}
+
+template <typename S> void FruitStoreT<S>::setCapacity(int capacity) {
+  release();
+  xs = new Scalar[capacity];
+  ys = new Scalar[capacity];
+  rs = new Scalar[capacity];
+  rIndices = new uint32_t[capacity];
+  flagBits = new uint32_t[capacity];
+  lastXs = new Scalar[capacity];
+  lastYs = new Scalar[capacity];
+  relXs = new Scalar[capacity];
+  relYs = new Scalar[capacity];
+  rotations = new uint32_t[capacity];
+  bottomTouchFrames = new uint32_t[capacity];
+}
+
+template <typename S> void FruitStoreT<S>::release() {
+  delete[] xs;
+  delete[] ys;
+  delete[] rs;
+  delete[] rIndices;
+  delete[] flagBits;
+  delete[] lastXs;
+  delete[] lastYs;
+  delete[] relXs;
+  delete[] relYs;
+  delete[] rotations;
+  delete[] bottomTouchFrames;
+  xs = ys = rs = lastXs = lastYs = relXs = relYs = nullptr;
+  rIndices = flagBits = rotations = bottomTouchFrames = nullptr;
+}
+
+template <typename S> void FruitStoreT<S>::load(const Fruit *fruits, int numFruits, bool rolling) {
+  for (int i = 0; i < numFruits; ++i) {
+    const Fruit &f(fruits[i]);
+    xs[i] = f.pos.x;
+    ys[i] = f.pos.y;
+    rs[i] = f.r;
+    rIndices[i] = f.rIndex;
+    flagBits[i] = f.flags;
+    lastXs[i] = f.lastPos.x;
+    lastYs[i] = f.lastPos.y;
+    bottomTouchFrames[i] = f.bottomTouchFrame;
+  }
+  if (!rolling) return;
+  for (int i = 0; i < numFruits; ++i) {
+    const Fruit &f(fruits[i]);
+    relXs[i] = f.relSum.x;
+    relYs[i] = f.relSum.y;
+    rotations[i] = f.rotation;
+  }
+}
+
+template <typename S> void FruitStoreT<S>::store(Fruit *fruits, int numFruits, bool rolling) const {
+  for (int i = 0; i < numFruits; ++i) {
+    Fruit &f(fruits[i]);
+    f.pos.x = xs[i];
+    f.pos.y = ys[i];
+    f.r = rs[i];
+    f.r2 = rs[i] * rs[i];
+    f.rIndex = rIndices[i];
+    f.flags = flagBits[i];
+    f.lastPos.x = lastXs[i];
+    f.lastPos.y = lastYs[i];
+    f.bottomTouchFrame = bottomTouchFrames[i];
+  }
+  if (!rolling) return;
+  for (int i = 0; i < numFruits; ++i) {
+    Fruit &f(fruits[i]);
+    f.relSum.x = relXs[i];
+    f.relSum.y = relYs[i];
+    f.rotation = rotations[i];
+  }
+}
+
+template <typename S> void FruitStoreT<S>::copy(int to, int from) {
+  xs[to] = xs[from];
+  ys[to] = ys[from];
+  rs[to] = rs[from];
+  rIndices[to] = rIndices[from];
+  flagBits[to] = flagBits[from];
+  lastXs[to] = lastXs[from];
+  lastYs[to] = lastYs[from];
+  relXs[to] = relXs[from];
+  relYs[to] = relYs[from];
+  rotations[to] = rotations[from];
+  bottomTouchFrames[to] = bottomTouchFrames[from];
+}
+
+inline BroadphaseGrid::~BroadphaseGrid() {
+  delete[] cellStart;
+  delete[] entries;
+  delete[] bounds;
+}
+
+inline void BroadphaseGrid::setCapacity(int capacity) {
+  delete[] entries;
+  delete[] bounds;
+  entryCap = capacity * entriesPerFruit;
+  entries = new uint16_t[entryCap];
+  bounds = new uint8_t[capacity][4];
+}
+
+template <typename S> void BroadphaseGrid::setup(S worldWidth, S worldHeight, S maxRadius) {
+  cellsX = clampCell(scalarFloor(worldWidth) + 1, maxCells + 1);
+  int worldRows = scalarFloor(worldHeight) + 1;
+  // fruits may be stacked above the world: the rows left over are
+  // used for that, but there is always room for the largest fruit,
+  // anything even higher than that shares the topmost row
+  rowsAbove = minCellsY - worldRows;
+  int minRowsAbove = scalarFloor(maxRadius * 2) + 1;
+  if (rowsAbove < minRowsAbove) rowsAbove = minRowsAbove;
+  cellsY = clampCell(worldRows + rowsAbove, maxCells + 1);
+  if (cellsX * cellsY > cellCap) {
+    cellCap = cellsX * cellsY;
+    delete[] cellStart;
+    cellStart = new uint32_t[cellCap + 1];
+  }
+}
+
+template <typename Layout> bool BroadphaseGrid::build(Layout &l, int numFruits) {
+  int numCells = cellsX * cellsY;
+  for (int c = 0; c <= numCells; ++c) {
+    cellStart[c] = 0;
+  }
+  int numEntries = 0;
+  for (int i = 0; i < numFruits; ++i) {
+    typename Layout::Scalar x = l.x(i);
+    typename Layout::Scalar y = l.y(i);
+    typename Layout::Scalar r = l.r(i);
+    uint8_t *b = bounds[i];
+    b[0] = clampCell(scalarFloor(x - r), cellsX);
+    b[1] = clampCell(scalarFloor(y - r) + rowsAbove, cellsY);
+    b[2] = clampCell(scalarFloor(x + r), cellsX);
+    b[3] = clampCell(scalarFloor(y + r) + rowsAbove, cellsY);
+    numEntries += (b[2] - b[0] + 1) * (b[3] - b[1] + 1);
+    if (numEntries > entryCap) return false;
+    for (int y = b[1]; y <= b[3]; ++y) {
+      for (int x = b[0]; x <= b[2]; ++x) {
+        ++cellStart[x + y * cellsX];
+      }
+    }
+  }
+  // cellStart[c] becomes the end of cell c...
+  for (int c = 1; c <= numCells; ++c) {
+    cellStart[c] += cellStart[c - 1];
+  }
+  // ...and filling backwards moves it to the start, while keeping
+  // the indices ascending within each cell
+  for (int i = numFruits - 1; i >= 0; --i) {
+    const uint8_t *b = bounds[i];
+    for (int y = b[1]; y <= b[3]; ++y) {
+      for (int x = b[0]; x <= b[2]; ++x) {
+        entries[--cellStart[x + y * cellsX]] = i;
+      }
+    }
+  }
+  return true;
+}
+
+template <typename S, typename Visitor> void BroadphaseGrid::visit(S x0, S y0, S x1, S y1, Visitor visitor) const {
+  int cx0 = clampCell(scalarFloor(x0), cellsX);
+  int cx1 = clampCell(scalarFloor(x1), cellsX);
+  int cy0 = clampCell(scalarFloor(y0) + rowsAbove, cellsY);
+  int cy1 = clampCell(scalarFloor(y1) + rowsAbove, cellsY);
+  for (int cy = cy0; cy <= cy1; ++cy) {
+    for (int cx = cx0; cx <= cx1; ++cx) {
+      const uint16_t *end = cellEnd(cx + cy * cellsX);
+      for (const uint16_t *e = cellBegin(cx + cy * cellsX); e < end; ++e) {
+        visitor(*e);
+      }
+    }
+  }
+}
+
+template <typename S> FruitIndexT<S>::~FruitIndexT() {
+  delete[] head;
+  delete[] next;
+  delete[] prev;
+  delete[] cellOf;
+}
+
+template <typename S> void FruitIndexT<S>::setCapacity(int capacity) {
+  delete[] next;
+  delete[] prev;
+  delete[] cellOf;
+  next = new int16_t[capacity];
+  prev = new int16_t[capacity];
+  cellOf = new int32_t[capacity];
+  numIndexed = 0;
+}
+
+template <typename S> void FruitIndexT<S>::setup(Scalar worldWidth, Scalar worldHeight, Scalar maxRadius) {
+  const int maxCells = BroadphaseGrid::maxCells;
+  cellsX = clampCell(scalarFloor(worldWidth) + 1, maxCells + 1);
+  int worldRows = scalarFloor(worldHeight) + 1;
+  // the same room above the world as the broadphase grid has
+  rowsAbove = BroadphaseGrid::minCellsY - worldRows;
+  int minRowsAbove = scalarFloor(maxRadius * 2) + 1;
+  if (rowsAbove < minRowsAbove) rowsAbove = minRowsAbove;
+  cellsY = clampCell(worldRows + rowsAbove, maxCells + 1);
+  if (cellsX * cellsY > cellCap) {
+    cellCap = cellsX * cellsY;
+    delete[] head;
+    head = new int16_t[cellCap];
+  }
+  clear();
+}
+
+template <typename S> void FruitIndexT<S>::clear() {
+  for (int c = 0; c < cellsX * cellsY; ++c) {
+    head[c] = -1;
+  }
+  numIndexed = 0;
+  reach = 0;
+}
+
+template <typename S> void FruitIndexT<S>::link(int i, int cell) {
+  cellOf[i] = cell;
+  prev[i] = -1;
+  next[i] = head[cell];
+  if (next[i] >= 0) prev[next[i]] = i;
+  head[cell] = i;
+}
+
+template <typename S> void FruitIndexT<S>::unlink(int i) {
+  if (prev[i] >= 0) {
+    next[prev[i]] = next[i];
+  } else {
+    head[cellOf[i]] = next[i];
+  }
+  if (next[i] >= 0) prev[next[i]] = prev[i];
+}
+
+template <typename S> void FruitIndexT<S>::update(const Fruit *fruits, int numFruits) {
+  Scalar largest = 0;
+  for (int i = 0; i < numFruits; ++i) {
+    const Fruit &f(fruits[i]);
+    int cell = cellAt(f.pos.x, f.pos.y);
+    if (i >= numIndexed) {
+      link(i, cell);
+    } else if (cellOf[i] != cell) {
+      unlink(i);
+      link(i, cell);
+    }
+    if (largest < f.r) largest = f.r;
+  }
+  truncate(numFruits);
+  numIndexed = numFruits;
+  reach = largest;
+}
+
+template <typename S> void FruitIndexT<S>::append(const Fruit &f) {
+  link(numIndexed++, cellAt(f.pos.x, f.pos.y));
+  if (reach < f.r) reach = f.r;
+}
+
+template <typename S> void FruitIndexT<S>::truncate(int numFruits) {
+  while (numIndexed > numFruits) {
+    unlink(--numIndexed);
+  }
+}
+
+template <typename S> template <typename Visitor> bool FruitIndexT<S>::visit(Scalar x0, Scalar y0, Scalar x1, Scalar y1, Visitor visitor) const {
+  int cx0 = clampCell(scalarFloor(x0 - reach), cellsX);
+  int cx1 = clampCell(scalarFloor(x1 + reach), cellsX);
+  int cy0 = clampCell(scalarFloor(y0 - reach) + rowsAbove, cellsY);
+  int cy1 = clampCell(scalarFloor(y1 + reach) + rowsAbove, cellsY);
+  for (int cy = cy0; cy <= cy1; ++cy) {
+    for (int cx = cx0; cx <= cx1; ++cx) {
+      for (int i = head[cx + cy * cellsX]; i >= 0; i = next[i]) {
+        if (visitor(i)) return true;
+      }
+    }
+  }
+  return false;
+}
+
+template <typename S> void ContactCacheT<S>::setCapacity(int capacity) {
+  delete[] slots;
+  delete[] links;
+  numIds = capacity;
+  slots = capacity ? new Slot[capacity][slotsPerFruit] : nullptr;
+  links = capacity ? new uint16_t[capacity][linksPerFruit] : nullptr;
+  clear();
+}
+
+template <typename S> void ContactCacheT<S>::clear() {
+  for (int id = 0; id < numIds; ++id) {
+    for (int k = 0; k < slotsPerFruit; ++k) {
+      slots[id][k].other = noContact;
+    }
+    for (int k = 0; k < linksPerFruit; ++k) {
+      links[id][k] = noContact;
+    }
+  }
+}
+
+template <typename S> void ContactCacheT<S>::add(int idA, int kindA, int idB, int kindB, Point push) {
+  if (idA > idB) {
+    int id = idA;
+    idA = idB;
+    idB = id;
+    int kind = kindA;
+    kindA = kindB;
+    kindB = kind;
+    push = Point(-push.x, -push.y);
+  }
+  Slot *free = nullptr;
+  for (int k = 0; k < slotsPerFruit; ++k) {
+    Slot &slot(slots[idA][k]);
+    if (slot.other == idB) {
+      slot.push += push;
+      slot.touched = 1;
+      return;
+    }
+    if (!free && slot.other == noContact) free = &slot;
+  }
+  if (!free) return;
+  // a link left behind by a dropped pair can be taken again
+  uint16_t *link = nullptr;
+  for (int k = 0; k < linksPerFruit; ++k) {
+    uint16_t &low(links[idB][k]);
+    if (low == idA) {
+      link = &low;
+      break;
+    }
+    if (!link && (low == noContact || !hasPair(low, idB))) link = &low;
+  }
+  if (!link) return;
+  *link = idA;
+  free->other = idB;
+  free->kinds = packKinds(kindA, kindB);
+  free->touched = 1;
+  free->push = push;
+}
+
+template <typename S> void ContactCacheT<S>::release(int id) {
+  for (int k = 0; k < slotsPerFruit; ++k) {
+    slots[id][k].other = noContact;
+  }
+  // the lower ids having it in their rows are linked from its own
+  for (int k = 0; k < linksPerFruit; ++k) {
+    int low = links[id][k];
+    if (low == noContact) continue;
+    links[id][k] = noContact;
+    for (int s = 0; s < slotsPerFruit; ++s) {
+      if (slots[low][s].other == id) slots[low][s].other = noContact;
+    }
+  }
+}
+
+template <typename S> void ContactCacheT<S>::age(int id) {
+  for (int k = 0; k < slotsPerFruit; ++k) {
+    if (!slots[id][k].touched) slots[id][k].other = noContact;
+  }
+}
+
+template <typename S> void ContactCacheT<S>::copyFrom(const ContactCacheT &other) {
+  if (numIds != other.numIds) setCapacity(other.numIds);
+  for (int id = 0; id < numIds; ++id) {
+    for (int k = 0; k < slotsPerFruit; ++k) {
+      slots[id][k] = other.slots[id][k];
+    }
+    for (int k = 0; k < linksPerFruit; ++k) {
+      links[id][k] = other.links[id][k];
+    }
+  }
+}
+
+template <typename S, typename R> FruitSimT<S, R>::FruitSimT(int capacity):
+    fruitCap(0), fruits(nullptr), numFruits(0), worldWidth(Constants<S>::defaultWorldSizeX), worldHeight(Constants<S>::defaultWorldSizeY),
+    mortonShift(0), score(0), useBroadphase(true), useContactKernel(true), useSleeping(true), compact(false), numAwake(0),
+    minIterations(16), maxIterations(16), lastIterations(0),
+    penetrationTolerance(0), layout(FruitLayout::structOfArrays), gridStale(true), gridFits(false), wakeStack(nullptr), jobs(nullptr),
+    fruitBand(nullptr), rowBand(nullptr), rowOnBorder(nullptr), mergeEvents(nullptr), numMergeEvents(0),
+    usedIds(nullptr), scratch(nullptr), warmStarting(false), reorderInterval(64), stepsSinceReorder(0) {
+  stats.clear();
+  setupWorld();
+  setMaxNumFruits(capacity);
+}
+
+template <typename S, typename R> FruitSimT<S, R>::~FruitSimT() {
+  release();
+  delete[] rowBand;
+  delete[] rowOnBorder;
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::allocate() {
+  fruits = new Fruit[fruitCap];
+  wakeStack = new uint16_t[fruitCap];
+  fruitBand = new int8_t[fruitCap];
+  mergeEvents = new MergeEvent[fruitCap];
+  usedIds = new uint32_t[(fruitCap + 31) / 32];
+  scratch = new uint32_t[fruitCap * 2];
+  store.setCapacity(fruitCap);
+  grid.setCapacity(fruitCap);
+  spatialIndex.setCapacity(fruitCap);
+  // only a session warm starting needs the contacts
+  contacts.setCapacity(warmStarting ? fruitCap : 0);
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::release() {
+  delete[] fruits;
+  delete[] wakeStack;
+  delete[] fruitBand;
+  delete[] mergeEvents;
+  delete[] usedIds;
+  delete[] scratch;
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::setMaxNumFruits(int capacity) {
+  if (capacity < 32) capacity = 32;
+  if (capacity > maxFruitCap) capacity = maxFruitCap;
+  if (capacity != fruitCap) {
+    release();
+    fruitCap = capacity;
+    allocate();
+  }
+  numMergeEvents = 0;
+  newGame();
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::setupWorld() {
+  grid.setup(worldWidth, worldHeight, Constants<S>::radii[numRadii - 1]);
+  spatialIndex.setup(worldWidth, worldHeight, Constants<S>::radii[numRadii - 1]);
+  delete[] rowBand;
+  delete[] rowOnBorder;
+  rowBand = new int8_t[grid.getNumRows()];
+  rowOnBorder = new bool[grid.getNumRows()];
+  // the rows above the world count as well
+  int extent = scalarFloor(worldWidth) > scalarFloor(worldHeight) + 64 ? scalarFloor(worldWidth) : scalarFloor(worldHeight) + 64;
+  for (mortonShift = 0; extent >> mortonShift > 255; ++mortonShift) { }
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::setWorldSize(Scalar width, Scalar height) {
+  Scalar smallest = Constants<S>::radii[numRadii - 1] * 2;
+  Scalar largest = maxWorldSize;
+  worldWidth = width < smallest ? smallest : width > largest ? largest : width;
+  worldHeight = height < smallest ? smallest : height > largest ? largest : height;
+  setupWorld();
+  // the sleepers aren't moved, the ones outside have to wake to be pushed back in
+  for (int i = 0; i < numFruits; ++i) {
+    Fruit &f(fruits[i]);
+    if (f.pos.x < f.r || f.pos.x > worldWidth - f.r || f.pos.y > worldHeight - f.r) {
+      f.flags = (f.flags & ~(FruitFlags::asleep | FruitFlags::restless | FruitFlags::grounded | FruitFlags::stillMask)) |
+          FruitFlags::woken | FruitFlags::stillUnit;
+    }
+  }
+  spatialIndex.update(fruits, numFruits);
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::setWarmStartingEnabled(bool newValue) {
+  if (newValue && !warmStarting) contacts.setCapacity(fruitCap);
+  if (!newValue && warmStarting) contacts.setCapacity(0);
+  warmStarting = newValue;
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::saveSnapshot(FruitSnapshotT<S> &snapshot) const {
+  if (snapshot.bufferSize < numFruits) {
+    delete[] snapshot.fruits;
+    snapshot.bufferSize = fruitCap;
+    snapshot.fruits = new Fruit[fruitCap];
+  }
+  for (int i = 0; i < numFruits; ++i) {
+    snapshot.fruits[i] = fruits[i];
+  }
+  snapshot.numFruits = numFruits;
+  snapshot.fruitCap = fruitCap;
+  snapshot.worldWidth = worldWidth;
+  snapshot.worldHeight = worldHeight;
+  snapshot.gravity = gravity;
+  snapshot.penetrationTolerance = penetrationTolerance;
+  snapshot.score = score;
+  snapshot.popCount = popCount;
+  snapshot.lastPopCount = lastPopCount;
+  snapshot.minIterations = minIterations;
+  snapshot.maxIterations = maxIterations;
+  snapshot.reorderInterval = reorderInterval;
+  snapshot.stepsSinceReorder = stepsSinceReorder;
+  snapshot.useBroadphase = useBroadphase;
+  snapshot.useContactKernel = useContactKernel;
+  snapshot.useSleeping = useSleeping;
+  snapshot.compact = compact;
+  snapshot.warmStarting = warmStarting;
+  snapshot.layout = layout;
+  if (warmStarting) snapshot.contacts.copyFrom(contacts);
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::restoreSnapshot(const FruitSnapshotT<S> &snapshot) {
+  if (snapshot.isEmpty()) return;
+  // both of them only reallocate if they change
+  setMaxNumFruits(snapshot.fruitCap);
+  setWarmStartingEnabled(snapshot.warmStarting);
+  if (worldWidth != snapshot.worldWidth || worldHeight != snapshot.worldHeight) {
+    worldWidth = snapshot.worldWidth;
+    worldHeight = snapshot.worldHeight;
+    setupWorld();
+  }
+  for (int i = 0; i < snapshot.numFruits; ++i) {
+    fruits[i] = snapshot.fruits[i];
+  }
+  numFruits = snapshot.numFruits;
+  gravity = snapshot.gravity;
+  penetrationTolerance = snapshot.penetrationTolerance;
+  score = snapshot.score;
+  popCount = snapshot.popCount;
+  lastPopCount = snapshot.lastPopCount;
+  minIterations = snapshot.minIterations;
+  maxIterations = snapshot.maxIterations;
+  reorderInterval = snapshot.reorderInterval;
+  stepsSinceReorder = snapshot.stepsSinceReorder;
+  useBroadphase = snapshot.useBroadphase;
+  useContactKernel = snapshot.useContactKernel;
+  useSleeping = snapshot.useSleeping;
+  compact = snapshot.compact;
+  layout = snapshot.layout;
+  numMergeEvents = 0;
+  // the ids are unique already, this only marks them used
+  assignIds();
+  if (warmStarting) contacts.copyFrom(snapshot.contacts);
+  spatialIndex.update(fruits, numFruits);
+}
+
+template <typename S, typename R> bool FruitSimT<S, R>::predictDrop(Scalar x, Scalar y, unsigned radiusIndex, int seed,
+    uint32_t frameIndex, int numSteps, DropPredictionT<S> &prediction) {
+  prediction.landed = false;
+  prediction.numSteps = 0;
+  prediction.chainLength = 0;
+  prediction.score = 0;
+  if (!addFruit(x, y, radiusIndex, seed)) return false;
+  int followed = fruits[numFruits - 1].id();
+  prediction.landing = fruits[numFruits - 1].pos;
+  prediction.landingKind = fruits[numFruits - 1].rIndex;
+  int scoreBefore = score;
+  for (int step = 1; step <= numSteps; ++step, ++frameIndex) {
+    simulate(frameIndex, frameIndex);
+    for (int k = 0; k < numMergeEvents; ++k) {
+      const MergeEvent &e(mergeEvents[k]);
+      if (e.idA != followed && e.idB != followed) continue;
+      if (prediction.chainLength < DropPredictionT<S>::maxChain) prediction.chain[prediction.chainLength] = e;
+      ++prediction.chainLength;
+      followed = e.rIndex < numRadii ? e.idA : -1;
+    }
+    if (!prediction.landed) prediction.numSteps = step;
+    if (followed < 0) break;
+    const Fruit *f = nullptr;
+    for (int i = 0; i < numFruits; ++i) {
+      if (fruits[i].id() == followed) {
+        f = fruits + i;
+        break;
+      }
+    }
+    if (!f) break;
+    // the merges after landing still count for the chain
+    if (!prediction.landed) {
+      prediction.landing = f->pos;
+      prediction.landingKind = f->rIndex;
+      prediction.landed = f->bottomTouchFrame == frameIndex;
+    }
+    if (f->flags & FruitFlags::asleep) break;
+  }
+  prediction.score = score - scoreBefore;
+  return true;
+}
+
+template <typename S, typename R> FruitT<S>* FruitSimT<S, R>::init(int worldSeed) {
+#ifdef SPEEDTESTING
+  numFruits = 128;
+  worldSeed = 7;
+#else
+  numFruits = 0;
+#endif
+  Random rand(worldSeed);
+  gravity = Constants<S>::defaultGravity;
+  spatialIndex.clear();
+  if (numFruits > fruitCap) numFruits = fruitCap;
+  for (int i = 0; i < numFruits; ++i) {
+    Fruit &f(fruits[i]);
+    f.rIndex = rand(numRandomRadii);
+    f.r = Constants<S>::radii[f.rIndex];
+    f.r2 = f.r * f.r;
+    f.rotation = rand() & 65535;
+    f.relSum = Point(0, 0);
+    f.flags = 0;
+
+    Scalar d = f.r * 2;
+
+    f.pos.x = rand.scalarFraction<S>() * (worldWidth - d) + f.r;
+    f.pos.y = rand.scalarFraction<S>() * (worldHeight - d) + f.r;
+
+    f.lastPos = f.pos;
+  }
+  assignIds();
+  spatialIndex.update(fruits, numFruits);
+  return fruits;
+}
+
+template <typename S, typename R> SolverTallyT<S> FruitSimT<S, R>::startTally() {
+  SolverTally tally = { 0, mergeEvents + numMergeEvents, 0, deepestOverlap, false };
+  return tally;
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::finishTally(Layout &l, const SolverTally &tally) {
+  score += tally.score;
+  popCount += tally.numMerges;
+  lastPopCount += tally.numMerges;
+  numMergeEvents += tally.numMerges;
+  deepestOverlap = tally.deepest;
+  SIM_STAT(stats.pairsTested += tally.pairsTested);
+  SIM_STAT(stats.pairsOverlapping += tally.pairsOverlapping);
+  // the indices have to stay valid until the end of the pass,
+  // so merged fruits are only removed afterwards
+  if (tally.anyDeletable) {
+    gridStale = true;
+    for (int i = 0; i < numFruits; ) {
+      if (l.flags(i) & FruitFlags::deletable) {
+        releaseId(fruitId(l.flags(i)));
+        l.copy(i, --numFruits);
+      } else {
+        ++i;
+      }
+    }
+  }
+}
+
+template <typename S, typename R> template <typename Layout, typename Visitor> void FruitSimT<S, R>::visitSleepers(Layout &l,
+    Scalar x0, Scalar y0, Scalar x1, Scalar y1, Visitor visitor) {
+  // the sleepers don't move, so a grid built earlier in the step still
+  // has them right until the merged planets are removed
+  if (gridStale) {
+    gridFits = grid.build(l, numFruits);
+    gridStale = false;
+  }
+  if (!gridFits) {
+    for (int i = 0; i < numFruits; ++i) {
+      if (l.flags(i) & FruitFlags::asleep) visitor(i);
+    }
+    return;
+  }
+  // a woken sleeper isn't visited again from its other cells
+  grid.visit(x0, y0, x1, y1, [&](int i) {
+    if (l.flags(i) & FruitFlags::asleep) visitor(i);
+  });
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::wakeSupported(Layout &l, int numWoken) {
+  // the sleepers resting on a woken planet may have lost their support
+  const Scalar largest = Constants<S>::radii[numRadii - 1];
+  while (numWoken) {
+    int i = wakeStack[--numWoken];
+    Scalar around = (l.r(i) + largest) * Constants<S>::supportReach;
+    visitSleepers(l, l.x(i) - around, l.y(i) - around, l.x(i) + around, l.y(i), [&](int j) {
+      if (!(l.y(j) < l.y(i))) return;
+      Scalar reach = (l.r(i) + l.r(j)) * Constants<S>::supportReach;
+      Scalar dx = l.x(j) - l.x(i);
+      Scalar dy = l.y(j) - l.y(i);
+      if (scalarAbs(dx) < reach && scalarAbs(dy) < reach && dx * dx + dy * dy < reach * reach) {
+        wake(l, j);
+        l.flags(j) &= ~FruitFlags::woken;
+        wakeStack[numWoken++] = j;
+      }
+    });
+  }
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::wakeTouched(Layout &l, int a, int b) {
+  int numWoken = 0;
+  if (l.flags(a) & FruitFlags::woken) {
+    l.flags(a) &= ~FruitFlags::woken;
+    wakeStack[numWoken++] = a;
+  }
+  if (l.flags(b) & FruitFlags::woken) {
+    l.flags(b) &= ~FruitFlags::woken;
+    wakeStack[numWoken++] = b;
+  }
+  if (numWoken) wakeSupported(l, numWoken);
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::wakeAround(Layout &l, int a) {
+  // reaches the neighbours of both merged planets
+  Scalar reach = l.r(a) * 3;
+  Scalar around = reach + Constants<S>::radii[numRadii - 1];
+  int numWoken = 0;
+  visitSleepers(l, l.x(a) - around, l.y(a) - around, l.x(a) + around, l.y(a) + around, [&](int i) {
+    Scalar r = reach + l.r(i);
+    Scalar dx = l.x(i) - l.x(a);
+    Scalar dy = l.y(i) - l.y(a);
+    if (scalarAbs(dx) < r && scalarAbs(dy) < r && dx * dx + dy * dy < r * r) {
+      wake(l, i);
+      l.flags(i) &= ~FruitFlags::woken;
+      wakeStack[numWoken++] = i;
+    }
+  });
+  if (numWoken) wakeSupported(l, numWoken);
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::solveBruteForce(Layout &l, uint32_t frameIndex) {
+  int lanes = useContactKernel ? contact::numLanes : 1;
+  CandidateGroup<Layout> group;
+  SolverTally tally = startTally();
+  for (int i = 1; i < numFruits; ++i) {
+    if (l.flags(i) & FruitFlags::deletable) continue;
+    for (int j = 0; j < i; ++j) {
+      if (lanes > 1) {
+        // skip the candidates that certainly don't touch fruit i
+        int candidates[contact::numLanes];
+        int n = i - j < lanes ? i - j : lanes;
+        for (int k = 0; k < n; ++k) candidates[k] = j + k;
+        group.gather(l, candidates, n);
+        uint32_t mask = group.overlapMask(l, i);
+        if (!mask) {
+          j += n - 1;
+          continue;
+        }
+        j += __builtin_ctz(mask);
+      }
+      if (l.flags(j) & FruitFlags::deletable) continue;
+      if (l.flags(i) & l.flags(j) & FruitFlags::asleep) continue;
+      // far away pairs would overflow the distance in fixed point
+      Scalar reach = l.r(i) + l.r(j);
+      if (!(scalarAbs(l.x(j) - l.x(i)) < reach && scalarAbs(l.y(j) - l.y(i)) < reach)) continue;
+      int scoreIncrement = keepDistance<R>(l, j, i, frameIndex, tally, warmStarting ? &contacts : nullptr);
+      if (useSleeping) wakeTouched(l, j, i);
+      if (scoreIncrement) {
+        recordMerge(l, j, i, scoreIncrement, tally);
+        if (useSleeping) wakeAround(l, j);
+        // i was merged into j
+        break;
+      }
+    }
+  }
+  finishTally(l, tally);
+}
+
+template <typename S, typename R> template <typename Layout, typename Filter> void FruitSimT<S, R>::solveCells(Layout &l, int cellBegin, int cellEnd,
+    uint32_t frameIndex, Filter filter, SolverTally &tally, bool wakeNow) {
+  int lanes = useContactKernel ? contact::numLanes : 1;
+  CandidateGroup<Layout> group;
+  for (int cell = cellBegin; cell < cellEnd; ++cell) {
+    const uint16_t *end = grid.cellEnd(cell);
+    for (const uint16_t *a = grid.cellBegin(cell); a < end; ++a) {
+      const uint16_t *b = a + 1;
+      while (b < end) {
+        if (l.flags(*a) & FruitFlags::deletable) break;
+        int candidates[contact::numLanes];
+        int n = 0;
+        for (; b < end && n < lanes; ++b) {
+          if ((l.flags(*b) & FruitFlags::deletable) || !grid.owns(cell, *a, *b) || !filter(*a, *b)) continue;
+          candidates[n++] = *b;
+        }
+        if (!n) break;
+        // a few candidates are cheaper to test one by one
+        bool vector = n >= contact::minCandidates;
+        if (vector) group.gather(l, candidates, n);
+        uint32_t mask = vector ? group.overlapMask(l, *a) : (1u << n) - 1;
+        while (mask) {
+          int k = __builtin_ctz(mask);
+          mask &= ~1u << k;
+          // pairs of sleepers are skipped, but either one may wake up meanwhile
+          if (l.flags(*a) & l.flags(candidates[k]) & FruitFlags::asleep) continue;
+          int scoreIncrement = keepDistance<R>(l, *a, candidates[k], frameIndex, tally, warmStarting ? &contacts : nullptr);
+          if (wakeNow) wakeTouched(l, *a, candidates[k]);
+          if (scoreIncrement) {
+            recordMerge(l, *a, candidates[k], scoreIncrement, tally);
+            if (wakeNow) wakeAround(l, *a);
+            if (l.flags(*a) & FruitFlags::deletable) break;
+          }
+          // a moves if they touch, so the candidates after it are tested again
+          if (vector) mask = group.overlapMask(l, *a) & (~1u << k);
+        }
+      }
+    }
+  }
+}
+
+namespace {
+  struct AnyPair {
+    inline bool operator()(int, int) const {
+      return true;
+    }
+  };
+
+  struct PairInBand {
+    const int8_t *fruitBand;
+    int band;
+
+    inline bool operator()(int a, int b) const {
+      return fruitBand[a] == band && fruitBand[b] == band;
+    }
+  };
+
+  struct PairOnBorder {
+    const int8_t *fruitBand;
+
+    inline bool operator()(int a, int b) const {
+      return fruitBand[a] < 0 || fruitBand[b] < 0;
+    }
+  };
+
+  template <typename Sim, typename Layout> struct BandContext {
+    Sim *sim;
+    Layout *l;
+    uint32_t frameIndex;
+  };
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::solveBand(void *context, int band) {
+  BandContext<FruitSimT, Layout> &c(*static_cast<BandContext<FruitSimT, Layout>*>(context));
+  FruitSimT &sim(*c.sim);
+  SolverBand &b(sim.bands[band]);
+  int numColumns = sim.grid.getNumColumns();
+  PairInBand filter = { sim.fruitBand, band };
+  // the wake ups reach across the bands, so they are left for later
+  sim.solveCells(*c.l, b.rowBegin * numColumns, b.rowEnd * numColumns, c.frameIndex, filter, b.tally, false);
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::solveBands(Layout &l, uint32_t frameIndex, SolverTally &tally) {
+  int numBands = jobs->getNumThreads();
+  if (numBands > numFruits / minFruitsPerBand) numBands = numFruits / minFruitsPerBand;
+  if (numBands > maxSolverBands) numBands = maxSolverBands;
+  int numRows = grid.getNumRows();
+  int numColumns = grid.getNumColumns();
+  const uint16_t *firstEntry = grid.cellBegin(0);
+  int numEntries = grid.cellEnd(numRows * numColumns - 1) - firstEntry;
+  // the rows are split so that the bands get about the same number of entries
+  int row = 0;
+  int band = 0;
+  while (band < numBands && row < numRows) {
+    SolverBand &b(bands[band]);
+    int target = numEntries * (band + 1) / numBands;
+    b.rowBegin = row;
+    ++row;
+    while (row < numRows && (band == numBands - 1 || grid.cellBegin(row * numColumns) - firstEntry < target)) {
+      ++row;
+    }
+    b.rowEnd = row;
+    b.tally = tally;
+    b.tally.score = 0;
+    b.tally.numMerges = 0;
+    b.tally.anyDeletable = false;
+    SIM_STAT(b.tally.pairsTested = b.tally.pairsOverlapping = 0);
+    for (int r = b.rowBegin; r < b.rowEnd; ++r) {
+      rowBand[r] = band;
+      rowOnBorder[r] = false;
+    }
+    ++band;
+  }
+  numBands = band;
+  int bandSize[maxSolverBands] = { };
+  for (int i = 0; i < numFruits; ++i) {
+    int top = grid.topRow(i);
+    int bottom = grid.bottomRow(i);
+    if (rowBand[top] == rowBand[bottom]) {
+      fruitBand[i] = rowBand[top];
+      ++bandSize[fruitBand[i]];
+    } else {
+      fruitBand[i] = -1;
+      for (int r = top; r <= bottom; ++r) {
+        rowOnBorder[r] = true;
+      }
+    }
+  }
+
+  // each merge inside a band removes one of its planets,
+  // so the merges of a band fit in that many events
+  MergeEvent *merges = tally.merges + tally.numMerges;
+  for (int band = 0; band < numBands; ++band) {
+    bands[band].tally.merges = merges;
+    merges += bandSize[band];
+  }
+
+  BandContext<FruitSimT, Layout> context = { this, &l, frameIndex };
+  jobs->run(&FruitSimT::solveBand<Layout>, &context, numBands);
+
+  for (int band = 0; band < numBands; ++band) {
+    const SolverTally &t(bands[band].tally);
+    tally.score += t.score;
+    for (int i = 0; i < t.numMerges; ++i) {
+      tally.merges[tally.numMerges++] = t.merges[i];
+    }
+    if (tally.deepest < t.deepest) tally.deepest = t.deepest;
+    tally.anyDeletable = tally.anyDeletable || t.anyDeletable;
+    SIM_STAT(tally.pairsTested += t.pairsTested);
+    SIM_STAT(tally.pairsOverlapping += t.pairsOverlapping);
+  }
+  if (useSleeping) {
+    // the held back wake ups go in index order to stay deterministic,
+    // around a merged away planet reaches the neighbours of the pair too
+    for (int i = 0; i < numFruits; ++i) {
+      if (l.flags(i) & FruitFlags::deletable) wakeAround(l, i);
+    }
+    int numWoken = 0;
+    for (int i = 0; i < numFruits; ++i) {
+      if (l.flags(i) & FruitFlags::woken) {
+        l.flags(i) &= ~FruitFlags::woken;
+        wakeStack[numWoken++] = i;
+      }
+    }
+    if (numWoken) wakeSupported(l, numWoken);
+  }
+
+  // the pairs with a planet on a border are solved in their usual order
+  PairOnBorder filter = { fruitBand };
+  for (int r = 0; r < numRows; ++r) {
+    if (!rowOnBorder[r]) continue;
+    solveCells(l, r * numColumns, (r + 1) * numColumns, frameIndex, filter, tally, useSleeping);
+  }
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::solveBroadphase(Layout &l, uint32_t frameIndex) {
+  gridFits = grid.build(l, numFruits);
+  gridStale = false;
+  if (!gridFits) {
+    solveBruteForce(l, frameIndex);
+    return;
+  }
+  SolverTally tally = startTally();
+  // a small pile isn't worth the hand over to the other threads
+  if (jobs && jobs->getNumThreads() > 1 && numFruits >= minFruitsPerBand * 2) {
+    solveBands(l, frameIndex, tally);
+  } else {
+    solveCells(l, 0, grid.getNumCells(), frameIndex, AnyPair(), tally, useSleeping);
+  }
+  finishTally(l, tally);
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::solveAwake(Layout &l, uint32_t frameIndex) {
+  SolverTally tally = startTally();
+  for (int i = 0; i < numFruits; ++i) {
+    if (l.flags(i) & (FruitFlags::asleep | FruitFlags::deletable)) continue;
+    for (int j = 0; j < numFruits; ++j) {
+      uint32_t flagsJ = l.flags(j);
+      // pairs of awake fruits are tested once
+      if (j == i || (flagsJ & FruitFlags::deletable) || (j < i && !(flagsJ & FruitFlags::asleep))) continue;
+      // far away pairs would overflow the distance in fixed point
+      Scalar reach = l.r(i) + l.r(j);
+      if (!(scalarAbs(l.x(j) - l.x(i)) < reach && scalarAbs(l.y(j) - l.y(i)) < reach)) continue;
+      int scoreIncrement = keepDistance<R>(l, i, j, frameIndex, tally, warmStarting ? &contacts : nullptr);
+      wakeTouched(l, i, j);
+      if (scoreIncrement) {
+        recordMerge(l, i, j, scoreIncrement, tally);
+        wakeAround(l, i);
+        if (l.flags(i) & FruitFlags::deletable) break;
+      }
+    }
+  }
+  finishTally(l, tally);
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::step(Layout &l, uint32_t frameIndex) {
+  // apply gravity and movement
+  numAwake = 0;
+  gridStale = true;
+  for (int i = 0; i < numFruits; ++i) {
+    if (l.flags(i) & FruitFlags::asleep) {
+      // sleepers stay where they are, but still hold up the others
+      if (l.flags(i) & FruitFlags::grounded) l.bottomTouchFrame(i) = frameIndex;
+    } else {
+      move(l, i, gravity);
+      ++numAwake;
+    }
+  }
+  if (warmStarting && numAwake) warmStart(l);
+  // a pile at rest has nothing to solve
+  int numIter = numAwake ? maxIterations : 0;
+  lastIterations = 0;
+  for (int iter = 0; iter < numIter; ++iter) {
+    deepestOverlap = 0;
+    // apply constraints
+    if (useSleeping && numAwake * numFruits <= maxAwakePairs) {
+      // only a few are moving, so pairing them up with everything is cheaper
+      solveAwake(l, frameIndex);
+    } else if (useBroadphase) {
+      solveBroadphase(l, frameIndex);
+    } else {
+      solveBruteForce(l, frameIndex);
+    }
+    for (int i = 0; i < numFruits; ++i) {
+      if (!(l.flags(i) & FruitFlags::asleep) && constrainInside(l, i, frameIndex, worldWidth, worldHeight)) {
+        SIM_STAT(++stats.clamped);
+      }
+    }
+    ++lastIterations;
+    SIM_STAT(if (stats.maxPenetration < deepestOverlap) stats.maxPenetration = deepestOverlap);
+    if (lastIterations >= minIterations && deepestOverlap < penetrationTolerance) break;
+  }
+  // the pushes of every iteration are summed up in relSum, so the
+  // planets turn once by the direction of the sum and the step they made
+  if (!compact) {
+    for (int i = 0; i < numFruits; ++i) {
+      if (!(l.flags(i) & FruitFlags::asleep)) roll<R>(l, i);
+    }
+  }
+  if (useSleeping) {
+    for (int i = 0; i < numFruits; ++i) {
+      settle(l, i, frameIndex);
+    }
+  }
+  if (warmStarting && numIter) {
+    // the rows of the ids not in use were emptied when they were released
+    for (int i = 0; i < numFruits; ++i) {
+      contacts.age(fruitId(l.flags(i)));
+    }
+  }
+  SIM_STAT(stats.iterations = lastIterations);
+}
+
+template <typename S, typename R> template <typename Layout> void FruitSimT<S, R>::warmStart(Layout &l) {
+  typedef ContactCacheT<S> ContactCache;
+  const uint32_t notLive = 0xffffffffu;
+  uint32_t *indexOf = scratch;
+  for (int id = 0; id < fruitCap; ++id) {
+    indexOf[id] = notLive;
+  }
+  for (int i = 0; i < numFruits; ++i) {
+    indexOf[fruitId(l.flags(i))] = i;
+  }
+  for (int i = 0; i < numFruits; ++i) {
+    int id = fruitId(l.flags(i));
+    typename ContactCache::Slot *row = contacts.row(id);
+    for (int k = 0; k < ContactCache::slotsPerFruit; ++k) {
+      typename ContactCache::Slot &slot(row[k]);
+      if (slot.other == ContactCache::noContact) continue;
+      int j = indexOf[slot.other];
+      // merged or gone since, or not touching any more after the move
+      bool valid = indexOf[slot.other] != notLive && slot.kinds == ContactCache::packKinds(l.rIndex(i), l.rIndex(j));
+      if (valid) {
+        Point diff(l.x(j) - l.x(i), l.y(j) - l.y(i));
+        Scalar rsum = l.r(i) + l.r(j);
+        valid = scalarAbs(diff.x) < rsum && scalarAbs(diff.y) < rsum && diff * diff < rsum * rsum;
+      }
+      if (!valid) {
+        slot.other = ContactCache::noContact;
+        continue;
+      }
+      slot.push *= Constants<S>::warmStartRate;
+      slot.touched = 0;
+      // a pair of sleepers stays as it is, the sleeper wakes up if it has to
+      if (!(l.flags(i) & l.flags(j) & FruitFlags::asleep)) pushApart(l, i, j, slot.push);
+    }
+  }
+}
+
+template <typename S, typename R> FruitT<S>* FruitSimT<S, R>::simulate(int frameSeed, uint32_t frameIndex) {
+  lastPopCount = 0;
+  numMergeEvents = 0;
+  SIM_STAT(stats.clear());
+  if (layout == FruitLayout::structOfArrays) {
+    store.load(fruits, numFruits, !compact);
+    step(store, frameIndex);
+    store.store(fruits, numFruits, !compact);
+  } else {
+    FruitArrayT<S> array = { fruits };
+    step(array, frameIndex);
+  }
+  if (reorderInterval > 0 && ++stepsSinceReorder >= reorderInterval) {
+    stepsSinceReorder = 0;
+    reorder();
+  }
+  spatialIndex.update(fruits, numFruits);
+  SIM_STAT(stats.merges = numMergeEvents);
+  return fruits;
+}
+
+template <typename S, typename R> int FruitSimT<S, R>::allocateId() {
+  for (int w = 0; w < (fruitCap + 31) / 32; ++w) {
+    if (usedIds[w] == 0xffffffffu) continue;
+    int bit = __builtin_ctz(~usedIds[w]);
+    usedIds[w] |= 1u << bit;
+    return w * 32 + bit;
+  }
+  return 0;
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::releaseId(int id) {
+  usedIds[id >> 5] &= ~(1u << (id & 31));
+  // the next fruit getting the id doesn't take over the contacts
+  if (warmStarting) contacts.release(id);
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::assignIds() {
+  int numWords = (fruitCap + 31) / 32;
+  for (int w = 0; w < numWords; ++w) {
+    usedIds[w] = 0;
+  }
+  // the ids past the capacity in the last word are never handed out
+  if (fruitCap & 31) usedIds[numWords - 1] = ~0u << (fruitCap & 31);
+  contacts.clear();
+  uint32_t *duplicates = scratch;
+  int numDuplicates = 0;
+  for (int i = 0; i < numFruits; ++i) {
+    int id = fruits[i].id();
+    uint32_t bit = 1u << (id & 31);
+    // a saved id past the capacity can't be marked, it gets a new one too
+    if (id >= fruitCap || (usedIds[id >> 5] & bit)) {
+      duplicates[numDuplicates++] = i;
+    } else {
+      usedIds[id >> 5] |= bit;
+    }
+  }
+  // they get the ids left over
+  for (int k = 0; k < numDuplicates; ++k) {
+    Fruit &f(fruits[duplicates[k]]);
+    f.flags = (f.flags & ~FruitFlags::idMask) | allocateId() * FruitFlags::idUnit;
+  }
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::reorder() {
+  // a radix sort on the two bytes of the cell, it takes the same time
+  // however shuffled the fruits are, and the fruits in the same cell
+  // keep their order
+  uint32_t *keys = scratch;
+  uint32_t *sorted = scratch + fruitCap;
+  int counts[2][256] = { };
+  for (int i = 0; i < numFruits; ++i) {
+    uint32_t key = mortonCode(fruits[i], mortonShift) << 16 | i;
+    keys[i] = key;
+    ++counts[0][(key >> 16) & 0xff];
+    ++counts[1][key >> 24];
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    int *start = counts[pass];
+    int sum = 0;
+    for (int b = 0; b < 256; ++b) {
+      int count = start[b];
+      start[b] = sum;
+      sum += count;
+    }
+    int shift = 16 + pass * 8;
+    for (int i = 0; i < numFruits; ++i) {
+      sorted[start[(keys[i] >> shift) & 0xff]++] = keys[i];
+    }
+    uint32_t *swapped = keys;
+    keys = sorted;
+    sorted = swapped;
+  }
+  // the records are moved along the cycles of the permutation
+  for (int i = 0; i < numFruits; ++i) {
+    int from = keys[i] & 0xffff;
+    if (from == i) continue;
+    Fruit moved = fruits[i];
+    int j = i;
+    while (from != i) {
+      fruits[j] = fruits[from];
+      keys[j] = j;
+      j = from;
+      from = keys[j] & 0xffff;
+    }
+    fruits[j] = moved;
+    keys[j] = j;
+  }
+}
+
+template <typename S, typename R> int FruitSimT<S, R>::findGroundedOutside(uint32_t frameIndex) {
+  if (lastPopCount > 0) return -1;
+  return findGroundedAbove(0, frameIndex);
+}
+
+template <typename S, typename R> int FruitSimT<S, R>::findGroundedAbove(Scalar lineY, uint32_t frameIndex) const {
+  Scalar maxY = -worldHeight;
+  int found = -1;
+  // only the centres less than a radius below the line can reach above it
+  spatialIndex.visit(0, -worldHeight, worldWidth, lineY, [&](int i) {
+    const Fruit &f(fruits[i]);
+    if (f.bottomTouchFrame == frameIndex && f.pos.y - f.r < lineY &&
+        (maxY < f.pos.y || (maxY == f.pos.y && i < found))) {
+      found = i;
+      maxY = f.pos.y;
+    }
+    return false;
+  });
+  return found;
+}
+
+template <typename S, typename R> int FruitSimT<S, R>::findOverlapping(Scalar x, Scalar y, Scalar r, int *found, int maxFound) const {
+  Fruit circle;
+  circle.pos = Point(x, y);
+  circle.r = r;
+  int numFound = 0;
+  spatialIndex.visit(x - r, y - r, x + r, y + r, [&](int i) {
+    if (fruits[i].touches(circle)) {
+      if (numFound < maxFound) found[numFound] = i;
+      ++numFound;
+    }
+    return false;
+  });
+  return numFound;
+}
+
+template <typename S, typename R> bool FruitSimT<S, R>::addFruit(Scalar x, Scalar y, unsigned radiusIndex, int seed) {
+  Random rand(seed);
+  if (numFruits >= fruitCap) return false;
+  if (radiusIndex >= numRadii) radiusIndex = numRadii - 1;
+  int index = numFruits++;
+  Fruit &f(fruits[index]);
+  f.rIndex = radiusIndex;
+  f.r = Constants<S>::radii[f.rIndex];
+  f.r2 = f.r * f.r;
+  f.rotation = rand() & 65535;
+  // compact mode never writes it, so it has to start out defined
+  f.relSum = Point(0, 0);
+  f.flags = allocateId() * FruitFlags::idUnit;
+
+  if (x < f.r) x = f.r;
+  if (x > worldWidth - f.r) x = worldWidth - f.r;
+  if (y > worldHeight - f.r) y = worldHeight - f.r;
+
+  f.pos.x = x;
+  f.pos.y = y;
+
+  f.lastPos = f.pos;
+  spatialIndex.append(f);
+  return true;
+}
+
+template <typename S, typename R> FruitT<S>* FruitSimT<S, R>::previewFruit(Scalar x, Scalar y, unsigned radiusIndex, int seed) {
+  int numFruitsBefore = numFruits;
+  Fruit *result = nullptr;
+  if (addFruit(x, y, radiusIndex, seed)) {
+    result = fruits + (numFruits - 1);
+    result->flags |= FruitFlags::sensor;
+    // the next fruit added gets the same id, and the renderer keeps its sprite
+    releaseId(result->id());
+  }
+  numFruits = numFruitsBefore;
+  spatialIndex.truncate(numFruits);
+  return result;
+}
+
+template <typename S, typename R> bool FruitSimT<S, R>::touchesAny(const Fruit &f) const {
+  return spatialIndex.visit(f.pos.x - f.r, f.pos.y - f.r, f.pos.x + f.r, f.pos.y + f.r, [&](int i) {
+    return fruits[i].touches(f);
+  });
+}
+
+template <typename S, typename R> int FruitSimT<S, R>::getNumRadii() {
+  return numRadii;
+}
+
+template <typename S, typename R> int FruitSimT<S, R>::getNumRandomRadii() {
+  return numRandomRadii;
+}
+
+template <typename S, typename R> S FruitSimT<S, R>::getRadius(int index) {
+  return Constants<S>::radii[index];
+}
+
+template <typename S, typename R> void FruitSimT<S, R>::setSleepingEnabled(bool newValue) {
+  useSleeping = newValue;
+  if (!useSleeping) {
+    for (int i = 0; i < numFruits; ++i) {
+      fruits[i].flags &= ~(FruitFlags::asleep | FruitFlags::grounded | FruitFlags::woken | FruitFlags::stillMask);
+    }
+  }
+}
+
+template <typename S, typename R> const char* FruitSimT<S, R>::getContactKernelName() {
+  return contact::kernelName;
+}
+
+template <typename S, typename R> int FruitSimT<S, R>::getPopCount() const {
+  return popCount;
+}
+
+template <typename S> void FruitSimBatchT<S>::simulateShare(void *context, int share) {
+  FruitSimBatchT &batch(*reinterpret_cast<FruitSimBatchT*>(context));
+  int numShares = batch.jobs ? batch.jobs->getNumThreads() : 1;
+  if (numShares > batch.numWorlds) numShares = batch.numWorlds;
+  int begin = batch.numWorlds * share / numShares;
+  int end = batch.numWorlds * (share + 1) / numShares;
+  for (int i = begin; i < end; ++i) {
+    batch.worlds[i]->simulate(batch.frameSeed, batch.frameIndex);
+  }
+}
+
+template <typename S> void FruitSimBatchT<S>::setCompact(bool newValue) {
+  for (int i = 0; i < numWorlds; ++i) {
+    worlds[i]->setCompact(newValue);
+  }
+}
+
+template <typename S> void FruitSimBatchT<S>::simulate(int newFrameSeed, uint32_t newFrameIndex) {
+  frameSeed = newFrameSeed;
+  frameIndex = newFrameIndex;
+  int numShares = jobs ? jobs->getNumThreads() : 1;
+  if (numShares > numWorlds) numShares = numWorlds;
+  if (numShares > 1) {
+    jobs->run(simulateShare, this, numShares);
+  } else if (numShares == 1) {
+    simulateShare(this, 0);
+  }
+}
@@ -0,0 +1,137 @@
+#include "atlas.hh"
+
+extern Platform platform;
+
+SpriteAtlas::SpriteAtlas(int pageSize, int budget):
+    pageSize(pageSize),
+    numPages(0),
+    pageTop(0),
+    numShelves(0),
+    scratch(nullptr),
+    scratchSpans(nullptr) {
+  int pageBytes = pageSize * pageSize * static_cast<int>(sizeof(uint32_t));
+  maxPages = budget / pageBytes;
+  if (maxPages < 1) maxPages = 1;
+  int numClasses = pageSize / classSize;
+  // every shelf could be of the smallest class
+  maxShelves = maxPages * numClasses;
+  maxCellsPerShelf = numClasses;
+  pages = new SDL_Surface*[maxPages];
+  pageSpans = new uint16_t*[maxPages];
+  spanPitch = numClasses * 4;
+  shelves = new Shelf[maxShelves];
+  nextFree = new int32_t[maxShelves * maxCellsPerShelf];
+  freeCells = new int32_t[numClasses];
+  for (int i = 0; i < numClasses; ++i) {
+    freeCells[i] = -1;
+  }
+}
+
+SpriteAtlas::~SpriteAtlas() {
+  for (int i = 0; i < numPages; ++i) {
+    SDL_FreeSurface(pages[i]);
+    delete[] pageSpans[i];
+  }
+  if (scratch) SDL_FreeSurface(scratch);
+  delete[] scratchSpans;
+  delete[] pages;
+  delete[] pageSpans;
+  delete[] shelves;
+  delete[] nextFree;
+  delete[] freeCells;
+}
+
+void SpriteAtlas::cutShelf(int shelf, int sizeClass) {
+  Shelf &s(shelves[shelf]);
+  s.size = (sizeClass + 1) * classSize;
+  s.numCells = pageSize / s.size;
+  s.numUsed = 0;
+  // backwards, so the cells are handed out from the left
+  for (int i = s.numCells - 1; i >= 0; --i) {
+    int cell = shelf * maxCellsPerShelf + i;
+    nextFree[cell] = freeCells[sizeClass];
+    freeCells[sizeClass] = cell;
+  }
+}
+
+bool SpriteAtlas::addShelf(int sizeClass) {
+  int size = (sizeClass + 1) * classSize;
+  if (!numPages || pageTop + size > pageSize) {
+    if (numPages < maxPages) {
+      pageSpans[numPages] = new uint16_t[pageSize * spanPitch];
+      pages[numPages++] = platform.createSurface(pageSize, pageSize);
+      pageTop = 0;
+    } else {
+      // the lowest empty shelf the class fits in
+      int best = -1;
+      for (int i = 0; i < numShelves; ++i) {
+        const Shelf &s(shelves[i]);
+        if (s.numUsed || s.height < size) continue;
+        if (best < 0 || s.height < shelves[best].height) best = i;
+      }
+      if (best < 0) return false;
+      int32_t *link = freeCells + shelves[best].size / classSize - 1;
+      while (*link >= 0) {
+        if (*link / maxCellsPerShelf == best) {
+          *link = nextFree[*link];
+        } else {
+          link = nextFree + *link;
+        }
+      }
+      cutShelf(best, sizeClass);
+      return true;
+    }
+  }
+  Shelf &s(shelves[numShelves]);
+  s.page = numPages - 1;
+  s.y = pageTop;
+  s.height = size;
+  pageTop += size;
+  cutShelf(numShelves++, sizeClass);
+  return true;
+}
+
+int SpriteAtlas::allocate(int size, Sprite &sprite) {
+  int sizeClass = getSizeClass(size);
+  if (!fits(size) ||
+      (freeCells[sizeClass] < 0 && !addShelf(sizeClass))) {
+    getScratch(size, sprite);
+    return -1;
+  }
+  int cell = freeCells[sizeClass];
+  freeCells[sizeClass] = nextFree[cell];
+  Shelf &s(shelves[cell / maxCellsPerShelf]);
+  ++s.numUsed;
+  int x = cell % maxCellsPerShelf * s.size;
+  sprite.page = pages[s.page];
+  sprite.rect.x = static_cast<Sint16>(x);
+  sprite.rect.y = static_cast<Sint16>(s.y);
+  sprite.rect.w = sprite.rect.h = static_cast<Uint16>(size);
+  sprite.spans = pageSpans[s.page] + s.y * spanPitch + x / classSize * 4;
+  sprite.spanPitch = spanPitch;
+  return cell;
+}
+
+void SpriteAtlas::release(int cell) {
+  Shelf &s(shelves[cell / maxCellsPerShelf]);
+  --s.numUsed;
+  int sizeClass = s.size / classSize - 1;
+  nextFree[cell] = freeCells[sizeClass];
+  freeCells[sizeClass] = cell;
+}
+
+void SpriteAtlas::getScratch(int size, Sprite &sprite) {
+  if (size < 1) size = 1;
+  if (!scratch || scratch->w < size) {
+    if (scratch) SDL_FreeSurface(scratch);
+    delete[] scratchSpans;
+    scratch = platform.createSurface(size, size);
+    scratchSpans = new uint16_t[size * 4];
+  }
+  sprite.page = scratch;
+  sprite.rect.x = 0;
+  sprite.rect.y = 0;
+  sprite.rect.w = sprite.rect.h = static_cast<Uint16>(size);
+  sprite.spans = scratchSpans;
+  sprite.spanPitch = 4;
+}
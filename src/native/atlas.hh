@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "platform.hh"
+
+/// A square sprite in a page of an atlas, or in its scratch surface
+struct Sprite {
+  SDL_Surface *page;
+  SDL_Rect rect;
+  /// Four numbers for each row, spanPitch apart: the first pixel that
+  /// isn't transparent, the first opaque one, the one past the opaque
+  /// run and the one past the last pixel that isn't transparent
+  uint16_t *spans;
+  int spanPitch;
+
+  inline PixelBuffer pixels() const {
+    return PixelBuffer(page).cropped(rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
+  }
+};
+
+/// Square sprites packed into a few large surfaces (pages). A page is cut
+/// into shelves spanning its width, a shelf into cells of the same size,
+/// and the sizes are rounded up to classes of 8 pixels. Each class keeps
+/// a list of its free cells, so taking a cell and giving it back doesn't
+/// allocate anything once the shelves are cut.
+/// New pages are made as long as the pages fit in the budget, then the
+/// empty shelves are cut again for other classes. A sprite that still
+/// doesn't fit gets the scratch surface, which is shared, so it has to be
+/// rendered again every time it is drawn.
+class SpriteAtlas {
+  static const int classSize = 8;
+
+  struct Shelf {
+    int page;
+    int y;
+    int height;
+    /// The class of the cells, it can be smaller than the height once
+    /// the shelf is cut again
+    int size;
+    int numCells;
+    int numUsed;
+  };
+
+  int pageSize;
+  int maxPages;
+  int numPages;
+  /// The top of the free part of the last page
+  int pageTop;
+  SDL_Surface **pages;
+  /// The spans of the rows of the cells, each page row has room for the
+  /// spans of as many cells as the smallest class fits in it
+  uint16_t **pageSpans;
+  int spanPitch;
+  int maxShelves;
+  int numShelves;
+  Shelf *shelves;
+  /// The cells of shelf i are i * maxCellsPerShelf and on
+  int maxCellsPerShelf;
+  int32_t *nextFree;
+  /// The first free cell of each class
+  int32_t *freeCells;
+  SDL_Surface *scratch;
+  uint16_t *scratchSpans;
+
+  /// Makes a shelf for the class, false if the budget doesn't allow it
+  bool addShelf(int sizeClass);
+  void cutShelf(int shelf, int sizeClass);
+public:
+  /// The pages are pageSize pixels wide and high, there are as many of
+  /// them as the budget in bytes allows, at least one; the spans take
+  /// another quarter of the size of the pages
+  SpriteAtlas(int pageSize, int budget);
+  ~SpriteAtlas();
+
+  /// Returns the cell holding the sprite, or -1 for the scratch surface
+  int allocate(int size, Sprite &sprite);
+  /// Gives back a cell returned by allocate
+  void release(int cell);
+  /// The scratch surface at least size pixels wide and high
+  void getScratch(int size, Sprite &sprite);
+
+  inline static int getSizeClass(int size) {
+    return (size - 1) / classSize;
+  }
+
+  /// Whether a sprite of the size can get a cell
+  inline bool fits(int size) const {
+    return size > 0 && size <= pageSize;
+  }
+
+  inline int getNumPages() const {
+    return numPages;
+  }
+};
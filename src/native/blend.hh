@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+// Channel arithmetic on 32 bit ARGB pixels
+
+inline uint64_t unpackColor(uint32_t col) {
+  return (((col & 0xff000000ULL) << 24) |
+      ((col & 0xff0000ULL) << 16) |
+      ((col & 0xff00ULL) << 8) |
+      col & 0xffULL);
+}
+
+inline uint32_t packColor(uint64_t v) {
+	return ((v >> 24) & 0xff000000u) |
+    ((v >> 16) & 0xff0000u) |
+		((v >> 8) & 0xff00u) |
+		(v & 0xffu);
+}
+
+inline uint32_t ablend(uint32_t col, uint8_t alpha) {
+	uint64_t v = unpackColor(col) * alpha;
+	return ((v >> 32) & 0xff000000u) |
+    ((v >> 24) & 0xff0000u) |
+		((v >> 16) & 0xff00u) |
+		((v >> 8) & 0xffu);
+}
@@ -0,0 +1,80 @@
+#include "damage.hh"
+
+namespace {
+  inline int area(const SDL_Rect &r) {
+    return r.w * r.h;
+  }
+
+  SDL_Rect bounds(const SDL_Rect &a, const SDL_Rect &b) {
+    int left = a.x < b.x ? a.x : b.x;
+    int top = a.y < b.y ? a.y : b.y;
+    int right = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+    int bottom = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+    return makeRect(left, top, right - left, bottom - top);
+  }
+}
+
+Damage::Damage(): numRects(0), width(0), height(0), full(true) { }
+
+void Damage::reset(int newWidth, int newHeight) {
+  width = newWidth;
+  height = newHeight;
+  addAll();
+}
+
+void Damage::clear() {
+  numRects = 0;
+  full = false;
+}
+
+void Damage::addAll() {
+  full = true;
+  numRects = 1;
+  rects[0] = makeRect(0, 0, width, height);
+}
+
+void Damage::merge(int index, SDL_Rect &r) {
+  r = bounds(rects[index], r);
+  rects[index] = rects[--numRects];
+}
+
+void Damage::add(int x, int y, int w, int h) {
+  if (full) return;
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (x + w > width) w = width - x;
+  if (y + h > height) h = height - y;
+  if (w <= 0 || h <= 0) return;
+  SDL_Rect r = makeRect(x, y, w, h);
+  while (true) {
+    int i = 0;
+    while (i < numRects && !rectsIntersect(rects[i], r)) ++i;
+    if (i == numRects) {
+      if (numRects < maxRects) break;
+      // too many, the bounding box may overlap others again
+      int growth = 0;
+      for (int j = 0; j < numRects; ++j) {
+        int g = area(bounds(rects[j], r)) - area(rects[j]);
+        if (j == 0 || g < growth) {
+          growth = g;
+          i = j;
+        }
+      }
+    }
+    merge(i, r);
+  }
+  rects[numRects++] = r;
+}
+
+bool Damage::intersects(const SDL_Rect &r) const {
+  for (int i = 0; i < numRects; ++i) {
+    if (rectsIntersect(rects[i], r)) return true;
+  }
+  return false;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "platform.hh"
+
+/// The parts of the screen that have to be drawn again, as rectangles
+/// that don't overlap, so a sprite drawn clipped to each of them blends
+/// every pixel only once. Overlapping rectangles are merged into their
+/// bounding box, and so is the one growing the least when there are too
+/// many of them.
+class Damage {
+  static const int maxRects = 64;
+
+  SDL_Rect rects[maxRects];
+  int numRects;
+  int width, height;
+  bool full;
+
+  void merge(int index, SDL_Rect &r);
+public:
+  Damage();
+
+  /// Sets the size of the screen and starts with all of it damaged
+  void reset(int newWidth, int newHeight);
+  /// Nothing damaged
+  void clear();
+  /// All of the screen damaged
+  void addAll();
+  void add(int x, int y, int w, int h);
+
+  inline void add(const SDL_Rect &r) {
+    add(r.x, r.y, r.w, r.h);
+  }
+
+  /// Whether the rectangle overlaps any of the damaged ones
+  bool intersects(const SDL_Rect &r) const;
+
+  inline bool isFull() const {
+    return full;
+  }
+
+  inline int getNumRects() const {
+    return numRects;
+  }
+
+  inline const SDL_Rect* getRects() const {
+    return rects;
+  }
+};
+
+/// Whether two rectangles share any pixels
+inline bool rectsIntersect(const SDL_Rect &a, const SDL_Rect &b) {
+  return a.x < b.x + b.w && b.x < a.x + a.w &&
+      a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+inline bool sameRect(const SDL_Rect &a, const SDL_Rect &b) {
+  return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
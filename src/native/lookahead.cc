@@ -0,0 +1,69 @@
+#include "lookahead.hh"
+
+DropLookahead::DropLookahead(int numSteps):
+    numSteps(numSteps),
+    pending(snapshots),
+    working(snapshots + 1),
+    anyLatest(false),
+    hasPending(false),
+    running(true) {
+  pthread_create(&thread, nullptr, threadMain, this);
+}
+
+DropLookahead::~DropLookahead() {
+  running = false;
+  requested.notifyAll();
+  pthread_join(thread, nullptr);
+}
+
+void* DropLookahead::threadMain(void *ptr) {
+  reinterpret_cast<DropLookahead*>(ptr)->worker();
+  return nullptr;
+}
+
+void DropLookahead::worker() {
+  while (true) {
+    requested.waitUntil([this]() {
+      return hasPending.load(std::memory_order_acquire) || !running;
+    });
+    if (!running) break;
+    lock.lock();
+    FruitSnapshot *taken = pending;
+    pending = working;
+    working = taken;
+    Request r = pendingRequest;
+    hasPending = false;
+    lock.unlock();
+
+    world.restoreSnapshot(*working);
+    // nobody sees the rotation of this world, the positions are the same
+    world.setCompact(true);
+    DropPrediction prediction;
+    if (!world.predictDrop(r.x, Scalar(-1.0f), r.radIndex, r.seed, r.frameIndex, numSteps, prediction)) continue;
+
+    lock.lock();
+    latest = prediction;
+    anyLatest = true;
+    lock.unlock();
+  }
+}
+
+void DropLookahead::request(const FruitSim &sim, Scalar x, int radIndex, int seed, uint32_t frameIndex) {
+  lock.lock();
+  sim.saveSnapshot(*pending);
+  pendingRequest.x = x;
+  pendingRequest.radIndex = radIndex;
+  pendingRequest.seed = seed;
+  pendingRequest.frameIndex = frameIndex;
+  hasPending = true;
+  lock.unlock();
+  requested.notifyAll();
+}
+
+bool DropLookahead::getPrediction(DropPrediction &prediction) {
+  lock.lock();
+  bool any = anyLatest;
+  if (any) prediction = latest;
+  lock.unlock();
+  return any;
+}
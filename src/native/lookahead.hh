@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <pthread.h>
+
+#include "util.hh"
+#include "../common/sim.hh"
+
+/// Plays the next drop forward on a copy of the world, on a thread of its
+/// own, so the game can show where the planet would land without waiting
+/// for it. A request only saves a snapshot of the world and returns; the
+/// thread always takes the latest request, the ones it didn't get to
+/// are dropped.
+class DropLookahead {
+  struct Request {
+    Scalar x;
+    int radIndex;
+    int seed;
+    uint32_t frameIndex;
+  };
+
+  /// Only the thread steps it
+  FruitSim world;
+  int numSteps;
+  /// The game saves into pending, the thread swaps it with working,
+  /// both under the lock
+  FruitSnapshot snapshots[2];
+  FruitSnapshot *pending;
+  FruitSnapshot *working;
+  Request pendingRequest;
+  DropPrediction latest;
+  bool anyLatest;
+  Mutex lock;
+  Condition requested;
+  std::atomic<bool> hasPending;
+  std::atomic<bool> running;
+  pthread_t thread;
+
+  static void* threadMain(void *ptr);
+  void worker();
+public:
+  /// It plays at most numSteps steps after the drop
+  explicit DropLookahead(int numSteps);
+  ~DropLookahead();
+
+  /// Asks for the planet to be dropped at x, y is always -1, into the
+  /// world as it is now, frameIndex is the index of the next step
+  void request(const FruitSim &sim, Scalar x, int radIndex, int seed, uint32_t frameIndex);
+  /// Copies the prediction of the last request done, if there is one yet
+  bool getPrediction(DropPrediction &prediction);
+};
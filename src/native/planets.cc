@@ -19,6 +19,11 @@
 #include "menu.hh"
 #include "input.hh"
 #include "miyoo_audio.hh"
+#include "speedtest.hh"
+#ifdef MULTICORE
+#include "workers.hh"
+#include "lookahead.hh"
+#endif
 
 struct TimeHistogram {
   uint32_t counts[256];
@@ -109,6 +114,105 @@ std::ostream& operator <<(std::ostream& s, const SectionTime &t) {
   return s;
 }
 
+/// Decides how many 10 ms steps of the simulation a game frame runs.
+/// A slow frame makes the next one owe more steps, which would make it
+/// slower still, so the steps a frame can catch up are capped and the
+/// time beyond them is dropped; the game slows down instead.
+/// The load is the time a step takes plus its share of drawing a frame,
+/// a frame every stepsPerFrame steps, over the 10 ms the step covers.
+/// Above 90% for a while the scheduler throttles, first the solver gets
+/// fewer iterations, then only every other frame is drawn; it goes back
+/// a level once the load stays under 50% for a while.
+class StepScheduler {
+public:
+  static const int stepMicros = 10000;
+  enum Level { full, fewerIterations, halfFrameRate, numLevels };
+private:
+  /// The load in 1/1024ths
+  static const uint32_t loadOne = 1024;
+  static const uint32_t loadHigh = loadOne * 9 / 10;
+  static const uint32_t loadLow = loadOne / 2;
+  static const int framesToThrottle = 30;
+  static const int framesToRecover = 120;
+
+  int maxSteps;
+  int stepsPerFrame;
+  Level level;
+  /// Running averages
+  uint32_t stepCost;
+  uint32_t drawCost;
+  uint32_t load;
+  int framesHigh;
+  int framesLow;
+  bool skipNextFrame;
+  uint64_t droppedMicros;
+  uint32_t numDroppingFrames;
+
+  static const char* levelName(Level l) {
+    switch (l) {
+      case full: return "full rate";
+      case fewerIterations: return "fewer solver iterations";
+      default: return "every other frame drawn";
+    }
+  }
+
+  void changeLevel(Level newLevel) {
+    std::cout << "Throttling: " << levelName(level) << " -> " << levelName(newLevel) <<
+        ", load " << load * 100 / loadOne << "%" << std::endl;
+    level = newLevel;
+    framesHigh = framesLow = 0;
+  }
+public:
+  /// A frame can catch up maxSteps steps at most
+  StepScheduler(int maxSteps, int stepsPerFrame): maxSteps(maxSteps), stepsPerFrame(stepsPerFrame),
+      level(full), stepCost(0), drawCost(0), load(0), framesHigh(0), framesLow(0),
+      skipNextFrame(false), droppedMicros(0), numDroppingFrames(0) { }
+
+  inline Level getLevel() const {
+    return level;
+  }
+
+  /// The steps of the frame out of the ones it owes, the rest are dropped
+  int limitSteps(int numSteps) {
+    if (numSteps <= maxSteps) return numSteps;
+    droppedMicros += static_cast<uint64_t>(numSteps - maxSteps) * stepMicros;
+    ++numDroppingFrames;
+    return maxSteps;
+  }
+
+  /// Whether to draw the frame, a frame ending the game is always drawn
+  bool shouldDraw(bool lastOfGame) {
+    skipNextFrame = level >= halfFrameRate && !skipNextFrame;
+    return lastOfGame || !skipNextFrame;
+  }
+
+  /// Notes the time the steps of a game frame took and the time it took
+  /// to draw it, returns whether the level changed
+  bool addFrame(int numSteps, uint32_t simMicros, bool drawn, uint32_t drawMicros) {
+    if (numSteps) stepCost = (stepCost * 7 + simMicros / numSteps) / 8;
+    if (drawn) drawCost = (drawCost * 7 + drawMicros) / 8;
+    int framesPerDraw = level >= halfFrameRate ? 2 : 1;
+    uint32_t perStep = stepCost + drawCost / (stepsPerFrame * framesPerDraw);
+    load = static_cast<uint64_t>(perStep) * loadOne / stepMicros;
+    framesHigh = load > loadHigh ? framesHigh + 1 : 0;
+    framesLow = load < loadLow ? framesLow + 1 : 0;
+    if (framesHigh >= framesToThrottle && level + 1 < numLevels) {
+      changeLevel(static_cast<Level>(level + 1));
+      return true;
+    }
+    if (framesLow >= framesToRecover && level > full) {
+      changeLevel(static_cast<Level>(level - 1));
+      return true;
+    }
+    return false;
+  }
+
+  void print(std::ostream &s = std::cout) const {
+    s << "dropped(sim) millis: " << droppedMicros / 1000 << " in " << numDroppingFrames << " frames\n";
+    s << "throttling: " << levelName(level) << ", load " << load * 100 / loadOne << "%\n";
+  }
+};
+
 const int dropOffset = 4953;
 
 struct ControlState {
@@ -230,10 +334,27 @@ class Planets: private GameSettings {
 #else
   static const int numSimStepsPerFrame = 1;
 #endif
+  /// A frame late by this many steps catches up with them, not more
+  static const int numCatchUpSteps = 3;
+  static const int minSolverIterations = 4;
+  static const int maxSolverIterations = 24;
+  static const int throttledSolverIterations = 12;
+#ifdef MULTICORE
+  /// A planet falls from the top to the bottom in about 100 steps
+  static const int numLookaheadSteps = 240;
+  /// The drop is played forward again every this many steps,
+  /// or right away once there is a new planet to drop
+  static const int lookaheadInterval = 4;
+#endif
 
   GameState state;
   GameState returnState;
   FruitSim sim;
+#ifdef MULTICORE
+  AutoDelete<WorkerPool> solverWorkers;
+  AutoDelete<DropLookahead> lookahead;
+  int lookaheadSeed;
+#endif
   Highscore highscores[highscoreCap];
   uint32_t numHighscores;
   SDL_Surface *screen;
@@ -259,7 +380,8 @@ class Planets: private GameSettings {
   Scalar zoom;
   Scalar offsetX;
 
-  int outlierIndex;
+  /// The id of the fruit that ended the game, or -1
+  int outlierId;
   int loseAnimationFrame;
 
   uint32_t seed;
@@ -279,6 +401,11 @@ class Planets: private GameSettings {
   SectionTime renderTime;
   SectionTime drawTime;
   SectionTime simTime;
+  StepScheduler scheduler;
+#ifdef SIM_STATS
+  /// What the solver did in the slowest sim step so far
+  SimStats slowestStepStats;
+#endif
   const char * const configFilePath;
 
   bool dropPending;
@@ -297,7 +424,10 @@ class Planets: private GameSettings {
   GameState processInput(const Timestamp &frame);
   void initAudio();
   void simulate();
-  void renderGame(GameState nextState, Scalar frameFraction);
+  /// Returns the microseconds it took
+  uint32_t renderGame(GameState nextState, Scalar frameFraction);
+  /// Sets the solver up for the level of the scheduler
+  void applyThrottling();
   void saveState();
   void loadState();
 
@@ -313,7 +443,7 @@ public:
       state(GameState::game),
       returnState(GameState::game),
       numHighscores(0),
-      outlierIndex(-1),
+      outlierId(-1),
       showFps(false),
       frameTime("frame"),
       gameFrame("gameFrame"),
@@ -321,6 +451,7 @@ public:
       renderTime("render"),
       drawTime("draw"),
       simTime("sim"),
+      scheduler(numSimStepsPerFrame + numCatchUpSteps, numSimStepsPerFrame),
       flipTime("flip"),
       eventTime("events"),
       menuButtonAlpha(0),
@@ -470,7 +601,7 @@ GameState Planets::processInput(const Timestamp &frame) {
         case Command::reset:
           sim.newGame();
           next.reset(sim, frame.getTime().tv_nsec);
-          outlierIndex = -1;
+          outlierId = -1;
           // since we started a new game, we are returning to the game
           // state explicitly (returnState may be the lost state)
           returnState = nextState = GameState::game;
@@ -525,7 +656,7 @@ void Planets::saveState() {
     file.write(reinterpret_cast<const char*>(&nsec), sizeof(nsec));
     next.copy(state.next);
     state.audioFlagsMuted = mixer.getFlagsMuted();
-    state.outlierIndex = outlierIndex;
+    state.outlierId = outlierId;
     state.simulationFrame = simulationFrame;
     state.score = sim.getScore();
     state.numHighscores = numHighscores;
@@ -597,7 +728,7 @@ void Planets::loadState() {
     if (success) {
       next.ingest(state.next);
       mixer.setFlagsMuted(state.audioFlagsMuted);
-      outlierIndex = state.outlierIndex;
+      outlierId = state.outlierId;
       simulationFrame = state.simulationFrame;
       sim.setNumFruits(state.numFruits);
       sim.setScore(state.score);
@@ -690,31 +821,55 @@ void Planets::initAudio() {
 
 void Planets::simulate() {
   simTime.start();
-  bool lostAlready = outlierIndex >= 0;
+  bool lostAlready = outlierId >= 0;
   if (state == GameState::game && !lostAlready) next.step(sim);
 
-  int popCountBefore = sim.getPopCount();
-
-  if (state == GameState::game && !lostAlready) sim.simulate(++seed, simulationFrame);
-
-  if (popCountBefore != sim.getPopCount())
-    mixer.playSound(&pop);
+  if (state == GameState::game && !lostAlready) {
+    sim.simulate(++seed, simulationFrame);
+    if (sim.getNumMergeEvents() > 0) mixer.playSound(&pop);
+  }
 
   next.setupPreview(sim);
-  if (state == GameState::game) simTime.end();
+#ifdef MULTICORE
+  if (lookahead && state == GameState::game && !lostAlready && next.valid &&
+      (simulationFrame % lookaheadInterval == 0 || next.seed != lookaheadSeed)) {
+    lookahead->request(sim, next.x, next.radIndex, next.seed, simulationFrame + 1);
+    lookaheadSeed = next.seed;
+  }
+#endif
+  if (state == GameState::game) {
+#ifdef SIM_STATS
+    if (simTime.end() >= simTime.maxMicros) slowestStepStats = sim.getStats();
+#else
+    simTime.end();
+#endif
+  }
 }
 
-void Planets::renderGame(GameState nextState, Scalar frameFraction) {
+uint32_t Planets::renderGame(GameState nextState, Scalar frameFraction) {
   renderTime.start();
-  SDL_BlitSurface(background, nullptr, screen, nullptr);
+  // the renderer restores the background where it draws
 
   drawTime.start();
   Fruit *fruits = sim.getFruits();
   int count = sim.getNumFruits();
-  renderer->renderFruits(sim, count + 1, next.radIndex, outlierIndex, simulationFrame, frameFraction, nextState == GameState::lost);
+#ifdef MULTICORE
+  DropPrediction prediction;
+  if (lookahead && nextState == GameState::game && lookahead->getPrediction(prediction) && prediction.landed) {
+    renderer->setLanding(prediction.landing, sim.getRadius(prediction.landingKind), prediction.chainLength > 0);
+  } else {
+    renderer->clearLanding();
+  }
+#endif
+  renderer->renderFruits(sim, count + 1, next.radIndex, outlierId, simulationFrame, frameFraction, nextState == GameState::lost);
   drawTime.end();
 
-  renderTime.end();
+  return renderTime.end();
+}
+
+void Planets::applyThrottling() {
+  bool fewer = scheduler.getLevel() >= StepScheduler::fewerIterations;
+  sim.setSolverIterations(minSolverIterations, fewer ? throttledSolverIterations : maxSolverIterations);
 }
 
 Platform platform;
@@ -761,6 +916,11 @@ void Planets::start() {
   }
 #endif
 
+#ifdef SPEEDTESTING
+  compareSimSpeeds();
+  compareSphereKernels();
+#endif
+
   std::cerr << "Initializing sim..." << std::endl;
 
   running = true;
@@ -771,6 +931,21 @@ void Planets::start() {
   seed = time.tv_nsec;
   sim.init(seed);
   sim.setGravity(Scalar(0.0078125f * 0.5f));
+  // calm frames stop early, merges get a few more iterations
+  applyThrottling();
+  sim.setPenetrationTolerance(Scalar(0.05f));
+#ifdef MULTICORE
+  int numCores = WorkerPool::getNumCores();
+  if (numCores > 1) {
+    // the quad core handhelds get a band of the pile on each core
+    solverWorkers = new WorkerPool(numCores < 4 ? numCores : 4);
+    sim.setSolverJobs(solverWorkers);
+    std::cout << "Solving on " << solverWorkers->getNumThreads() << " threads" << std::endl;
+    // on a single core it would take the time from the game
+    lookahead = new DropLookahead(numLookaheadSteps);
+    lookaheadSeed = -1;
+  }
+#endif
 
   std::cerr << "Initializing video..." << std::endl;
 
@@ -834,6 +1009,7 @@ void Planets::start() {
   menu = new Menu(*renderer, *this);
   renderer->setLayout(zoom, offsetX, sim);
   renderer->renderBackground(background);
+  renderer->setCompositing(platform.keepsFrames());
 
   Fruit *fruits;
 
@@ -854,11 +1030,16 @@ void Planets::start() {
     eventTime.end();
 
     bool justLost = false;
-    int lastWholeFrames = lastFrameMicros / 10000;
-    Scalar frameFraction = Scalar(lastFrameMicros % 10000) / 10000;
-    lastFrameMicros -= lastWholeFrames * 10000;
+    bool drawn = true;
+    // only the damage of the renderer changed on the screen
+    bool composited = false;
+    int lastWholeFrames = lastFrameMicros / StepScheduler::stepMicros;
+    lastFrameMicros -= lastWholeFrames * StepScheduler::stepMicros;
+    Scalar frameFraction = Scalar(lastFrameMicros) / StepScheduler::stepMicros;
     if (state == GameState::game) {
-      bool savedLostState = outlierIndex >= 0;
+      Timestamp stepsStart;
+      bool savedLostState = outlierId >= 0;
+      lastWholeFrames = scheduler.limitSteps(lastWholeFrames);
       for (int iter = 0; iter < lastWholeFrames; ++iter) {
         if (dropPending) {
           if (next.place(sim, frame.getTime().tv_nsec)) {
@@ -870,8 +1051,11 @@ void Planets::start() {
         simulate();
 
         if (!justLost && state == GameState::game && simulationFrame) {
-          if (!savedLostState) outlierIndex = sim.findGroundedOutside(simulationFrame);
-          if (outlierIndex >= 0) {
+          if (!savedLostState) {
+            int outlier = sim.findGroundedOutside(simulationFrame);
+            outlierId = outlier >= 0 ? sim.getFruits()[outlier].id() : -1;
+          }
+          if (outlierId >= 0) {
             justLost = true;
             loseAnimationFrame = 0;
             nextState = GameState::lost;
@@ -881,9 +1065,14 @@ void Planets::start() {
         }
       }
 
-      renderGame(nextState, frameFraction);
+      uint32_t simMicros = stepsStart.elapsedMicros();
+      drawn = scheduler.shouldDraw(nextState != GameState::game);
+      uint32_t drawMicros = drawn ? renderGame(nextState, frameFraction) : 0;
+      composited = drawn;
+      if (scheduler.addFrame(lastWholeFrames, simMicros, drawn, drawMicros)) applyThrottling();
     } else {
       SDL_BlitSurface(snapshot, nullptr, screen, nullptr);
+      renderer->invalidate();
       if (state == GameState::menu) {
         menu->render(screen, returnState != GameState::lost);
         if (returnState == GameState::lost) {
@@ -907,6 +1096,8 @@ void Planets::start() {
     }
     if (justLost) {
       renderer->renderLostScreen(sim.getScore(), highscores[0].score, nullptr, 0);
+      renderer->invalidate();
+      composited = false;
     }
     state = nextState;
 
@@ -924,8 +1115,15 @@ void Planets::start() {
     }
     flipTime.start();
 
-    // Update the screen
-    platform.present();
+    // Update the screen, a frame left undrawn leaves the last one on it
+    if (drawn) {
+      const Damage &damage(renderer->getDamage());
+      if (composited && !damage.isFull()) {
+        platform.present(damage.getRects(), damage.getNumRects());
+      } else {
+        platform.present();
+      }
+    }
 
 #if defined(DESKTOP)
 #endif
@@ -963,14 +1161,28 @@ void Planets::start() {
   std::cout << renderTime << std::endl;
   std::cout << drawTime << std::endl;
   std::cout << simTime << std::endl;
+  scheduler.print();
+#ifdef SIM_STATS
+  if (simTime.count) {
+    const SimStats &s(slowestStepStats);
+    std::cout << "slowest(sim): " << s.pairsTested << " pairs tested, " << s.pairsOverlapping << " overlapping, " <<
+        s.merges << " merges, " << s.iterations << " iterations, " << s.clamped << " clamped, " <<
+        static_cast<float>(s.maxPenetration) << " deepest\n" << std::endl;
+  }
+#endif
   std::cout << eventTime << std::endl;
   std::cout << flipTime << std::endl;
 
   std::cout << std::endl;
   std::cout << "sphereCacheMisses: " << SphereCache::numCacheMisses << std::endl;
-  std::cout << "sphereCacheAngleMisses: " << SphereCache::numCacheAngleMisses << std::endl;
-  std::cout << "sphereCacheReassignMisses: " << SphereCache::numCacheReassignMisses << std::endl;
+  std::cout << "sphereCacheEvictions: " << SphereCache::numCacheEvictions << std::endl;
   std::cout << "sphereCacheHits: " << SphereCache::numCacheHits << std::endl;
+  std::cout << "sphereCacheSharedHits: " << SphereCache::numCacheSharedHits << std::endl;
+  int numSphereLookups = SphereCache::numCacheHits + SphereCache::numCacheMisses;
+  if (numSphereLookups) {
+    std::cout << "sphereCacheSharing: " << SphereCache::numCacheSharedHits * 100.0f / numSphereLookups <<
+        "% of the planets drawn with a sprite rendered for another one" << std::endl;
+  }
 
   if (numHighscores) {
     dumpHighscore();
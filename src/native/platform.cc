@@ -324,27 +324,86 @@ void Platform::makeOpaque(SDL_Surface *s, bool opaque) {
 #endif
 }
 
-void Platform::present() {
+namespace {
+  /// Copies the rectangles of src into dst, turned the same way as the
+  /// orientation turns the whole screen, turnedRects gets where they end up
+  void copyTurned(SDL_Surface *src, SDL_Surface *dst, int orientation,
+      const SDL_Rect *rects, int numRects, SDL_Rect *turnedRects) {
+    SurfaceLocker s(src);
+    SurfaceLocker d(dst);
+    int sw = s.pb.width;
+    int sh = s.pb.height;
+    int pitch = d.pb.pitch;
+    // where the source pixel (0, 0) goes, and the steps for x and y
+    int origin = 0;
+    int dx = 1;
+    int dy = pitch;
+    bool flip = orientation & 2;
+    if (orientation & 1) {
+      origin = flip ? (sw - 1) * pitch : sh - 1;
+      dx = flip ? -pitch : pitch;
+      dy = flip ? 1 : -1;
+    } else if (flip) {
+      origin = (sh - 1) * pitch + sw - 1;
+      dx = -1;
+      dy = -pitch;
+    }
+    for (int i = 0; i < numRects; ++i) {
+      const SDL_Rect &r(rects[i]);
+      uint32_t *srcLine = s.pb.pixels + r.x + r.y * s.pb.pitch;
+      uint32_t *dstLine = d.pb.pixels + origin + r.x * dx + r.y * dy;
+      for (int y = 0; y < r.h; ++y) {
+        uint32_t *from = srcLine;
+        uint32_t *to = dstLine;
+        for (int x = 0; x < r.w; ++x) {
+          *to = *from++;
+          to += dx;
+        }
+        srcLine += s.pb.pitch;
+        dstLine += dy;
+      }
+      if (orientation & 1) {
+        turnedRects[i] = makeRect(flip ? r.y : sh - r.y - r.h, flip ? sw - r.x - r.w : r.x, r.h, r.w);
+      } else if (flip) {
+        turnedRects[i] = makeRect(sw - r.x - r.w, sh - r.y - r.h, r.w, r.h);
+      } else {
+        turnedRects[i] = r;
+      }
+    }
+  }
+}
+
+bool Platform::keepsFrames() const {
+#ifdef USE_SDL2
+  return true;
+#else
+  // a hardware surface flipped between two buffers doesn't, the ones
+  // drawn into before present always do
+  SDL_Surface *shown = rotated ? rotated : screen;
+  return (shown->flags & (SDL_HWSURFACE | SDL_DOUBLEBUF)) != (SDL_HWSURFACE | SDL_DOUBLEBUF);
+#endif
+}
+
+void Platform::present(const SDL_Rect *rects, int numRects) {
+  SDL_Rect whole = makeRect(0, 0, screen->w, screen->h);
+  if (!rects || numRects > maxPresentRects) {
+    rects = nullptr;
+    numRects = 1;
+  }
+  SDL_Rect turned[maxPresentRects];
 #ifdef USE_SDL2
   if (!forceTexture && (!orientation || softRotate)) {
     if (softRotate && (orientation & 1)) {
-      SurfaceLocker r(rotated);
-      SurfaceLocker s(screen);
-      bool flip = orientation & 2;
-      int increment = flip ? -s.pb.pitch : s.pb.pitch;
-      uint32_t *base = s.pb.pixels + (flip ? (r.pb.width - 1) * s.pb.pitch : 0);
-      for (int y = 0; y < r.pb.height; ++y) {
-        uint32_t *line = r.pb.pixels + y * r.pb.pitch;
-        uint32_t *column = base + (flip ? y : r.pb.height - y - 1);
-        for (int x = 0; x < r.pb.width; ++x) {
-          *column = *line;
-          ++line;
-          column += increment;
-        }
-      }
+      if (!rects) whole = makeRect(0, 0, rotated->w, rotated->h);
+      copyTurned(rotated, screen, orientation, rects ? rects : &whole, numRects, turned);
+      if (rects) rects = turned;
     }
     //SDL_RenderPresent(renderer);
-    SDL_UpdateWindowSurface(window);
+    if (rects) {
+      SDL_UpdateWindowSurfaceRects(window, rects, numRects);
+    } else {
+      SDL_UpdateWindowSurface(window);
+    }
   } else {
     // uint32_t *pixels = nullptr;
     // int pitch;
@@ -355,7 +414,16 @@ void Platform::present() {
     //   memcpy(pixels + pitch*y, lock.pb.pixels + y*lock.pb.pitch, lock.pb.width*4);
     // }
     // SDL_UnlockTexture(texture);
-    SDL_UpdateTexture(texture, nullptr, screen->pixels, screen->pitch);
+    if (rects) {
+      // the texture keeps the rest of the last frame
+      for (int i = 0; i < numRects; ++i) {
+        const SDL_Rect &r(rects[i]);
+        uint8_t *pixels = reinterpret_cast<uint8_t*>(screen->pixels) + r.y * screen->pitch + r.x * 4;
+        SDL_UpdateTexture(texture, &r, pixels, screen->pitch);
+      }
+    } else {
+      SDL_UpdateTexture(texture, nullptr, screen->pixels, screen->pitch);
+    }
     SDL_Rect dst {
       .x = (width - screen->w) >> 1,
       .y = (height - screen->h) >> 1,
@@ -367,57 +435,22 @@ void Platform::present() {
     SDL_RenderPresent(renderer);
   }
 #else
-  if (orientation) {
-    SurfaceLocker r(rotated);
-    SurfaceLocker s(screen);
-    if (orientation & 1) {
-      bool flip = orientation & 2;
-      int increment = flip ? -r.pb.pitch : r.pb.pitch;
-      uint32_t *base = r.pb.pixels + (flip ? (s.pb.width - 1) * r.pb.pitch : 0);
-      uint32_t *src = s.pb.pixels;
-      for (int y = 0; y < s.pb.height; ++y) {
-        uint32_t *line = src;
-        uint32_t *column = base + (flip ? y : s.pb.height - y - 1);
-        for (int x = 0; x < s.pb.width; ++x) {
-          *column = *line;
-          ++line;
-          column += increment;
-        }
-        src += s.pb.pitch;
-      }
-    } else {
-      uint32_t *src = s.pb.pixels;
-      uint32_t *dst = r.pb.pixels + (r.pb.height - 1) * r.pb.pitch + r.pb.width;
-      for (int y = 0; y < s.pb.height; ++y) {
-        uint32_t *srcLine = src;
-        uint32_t *dstLine = dst;
-        for (int x = 0; x < s.pb.width; ++x) {
-          *--dstLine = *srcLine++;
-        }
-        src += s.pb.pitch;
-        dst -= r.pb.pitch;
-      }
-    }
-  } else if (rotated) {
-    SurfaceLocker r(rotated);
-    SurfaceLocker s(screen);
-    uint32_t *src = s.pb.pixels;
-    uint32_t *dst = r.pb.pixels;
-    for (int y = 0; y < s.pb.height; ++y) {
-      uint32_t *srcLine = src;
-      uint32_t *dstLine = dst;
-      for (int x = 0; x < s.pb.width; ++x) {
-        *dstLine++ = *srcLine++;
-      }
-      src += s.pb.pitch;
-      dst += r.pb.pitch;
+  if (rotated) {
+    copyTurned(screen, rotated, orientation, rects ? rects : &whole, numRects, turned);
+  } else if (rects) {
+    // SDL_UpdateRects doesn't take const rectangles
+    for (int i = 0; i < numRects; ++i) {
+      turned[i] = rects[i];
     }
   }
-  SDL_Flip(rotated ? rotated : screen);
+  if (rects) {
+    SDL_UpdateRects(rotated ? rotated : screen, numRects, turned);
+  } else {
+    SDL_Flip(rotated ? rotated : screen);
+  }
 #endif
 }
 
-
 #ifdef _WIN32
 #define VC_EXTRALEAN
 #define WIN32_LEAN_AND_MEAN
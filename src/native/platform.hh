@@ -36,6 +36,8 @@ struct SoftSurface {
 };
 
 class Platform {
+  static const int maxPresentRects = 64;
+
   SDL_Surface *screen;
   SDL_Surface *rotated;
   int width, height;
@@ -58,7 +60,12 @@ public:
   SDL_Surface* createSurface(int width, int height);
   SoftSurface* createSoftSurface(int width, int height);
   void makeOpaque(SDL_Surface *s, bool opaque = true);
-  void present();
+  /// Shows the screen, or only the rectangles of it if there are any,
+  /// the rest is left as it was
+  void present(const SDL_Rect *rects = nullptr, int numRects = 0);
+  /// Whether the screen keeps its pixels after present, so the next
+  /// frame can be drawn over the last one
+  bool keepsFrames() const;
 #ifndef USE_SDL2
   void setSoftBackbufferEnabled(bool val) {
     useSoftBackbuffer = val;
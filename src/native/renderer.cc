@@ -5,10 +5,8 @@
 
 #include "image.hh"
 #include "font.hh"
-
-#if defined(BITTBOY) || defined(LOREZ)
-#define USE_QUICKBLIT
-#endif
+#include "blend.hh"
+#include "sphere_kernel.hh"
 
 #define ENABLE_PROFILING 0
 
@@ -16,44 +14,22 @@ extern Platform platform;
 
 const Scalar pi = Scalar(float(M_PI));
 
-// Uncomment this if the red and blue seems to be swapped
-//#define RED_BLUE_SWAP
-
-int SphereCache::numCacheHits = 0;
-int SphereCache::numCacheMisses = 0;
-int SphereCache::numCacheAngleMisses = 0;
-int SphereCache::numCacheReassignMisses = 0;
-
+// The atlas holding the sprites of the planets
 #if defined(BITTBOY) || defined(LOREZ)
-const unsigned TEXTURE_COORD_BITS = 7;
+const int atlasPageSize = 512;
+const int atlasBudget = 2 << 20;
 #else
-const unsigned TEXTURE_COORD_BITS = 9;
+const int atlasPageSize = 1024;
+const int atlasBudget = 16 << 20;
 #endif
 
-const unsigned TEXTURE_SIZE = 1 << TEXTURE_COORD_BITS;
-const unsigned TEXTURE_COORD_MASK = TEXTURE_SIZE - 1;
-
-inline uint64_t unpackColor(uint32_t col) {
-  return (((col & 0xff000000ULL) << 24) |
-      ((col & 0xff0000ULL) << 16) |
-      ((col & 0xff00ULL) << 8) |
-      col & 0xffULL);
-}
-
-inline uint32_t packColor(uint64_t v) {
-	return ((v >> 24) & 0xff000000u) |
-    ((v >> 16) & 0xff0000u) |
-		((v >> 8) & 0xff00u) |
-		(v & 0xffu);
-}
+// Uncomment this if the red and blue seems to be swapped
+//#define RED_BLUE_SWAP
 
-inline uint32_t ablend(uint32_t col, uint8_t alpha) {
-	uint64_t v = unpackColor(col) * alpha;
-	return ((v >> 32) & 0xff000000u) |
-    ((v >> 24) & 0xff0000u) |
-		((v >> 16) & 0xff00u) |
-		((v >> 8) & 0xffu);
-}
+int SphereCache::numCacheHits = 0;
+int SphereCache::numCacheSharedHits = 0;
+int SphereCache::numCacheMisses = 0;
+int SphereCache::numCacheEvictions = 0;
 
 void halfBlit(PixelBuffer src, PixelBuffer dst, int x, int y) {
   int w = src.width >> 1;
@@ -233,7 +209,71 @@ void ShadedSphere::initTables() {
 #endif
 }
 
+void ShadedSphere::findSpans(const PixelBuffer &lightmap, uint16_t *spans) {
+  for (int y = 0; y < lightmap.height; ++y) {
+    const uint32_t *line = lightmap.pixels + y * lightmap.pitch;
+    int first = 0;
+    int end = lightmap.width;
+    while (first < end && !line[first]) ++first;
+    while (end > first && !line[end - 1]) --end;
+    spans[y * 2] = first;
+    spans[y * 2 + 1] = end;
+  }
+}
+
 void ShadedSphere::render(PixelBuffer &target, int cx, int cy, int radius, int angle) {
+#ifdef FIXED
+  Fixed zoom = Fixed(static_cast<int>(TEXTURE_SIZE >> 1)) / radius;
+  int zv = zoom.f;
+  int cv = (sinLookup[(angle + 16384) & 0xFFFF] * zoom).f;
+  int sv = (sinLookup[angle & 0xFFFF] * zoom).f;
+#else
+  float zoom = (TEXTURE_SIZE * 0.5f) / radius;
+  float rad = angle / 32768.0f * pi;
+  int zv = zoom * 65536.0f;
+  int cv = cosf(rad) * 65536.0f * zoom;
+  int sv = sinf(rad) * 65536.0f * zoom;
+#endif
+  int w = 2*radius;
+  int h = w;
+  int p = target.pitch;
+  // the same matrix as renderReference
+  int u = -w * (cv >> 1) - -h * (sv >> 1) + (TEXTURE_SIZE << 15);
+  int v = -w * (sv >> 1) + -h * (cv >> 1) + (TEXTURE_SIZE << 15);
+  int s = -w * (zv >> 1) + (TEXTURE_SIZE << 15);
+  int t = -h * (zv >> 1) + (TEXTURE_SIZE << 15);
+  uint32_t *d = target.pixels +
+      (cx - radius) + p*(cy - radius);
+  for (int y = 0; y <= h; ++y) {
+    int rt = (t >> 16) & TEXTURE_COORD_MASK;
+    // the pixels on the two sides, where the lightmap is transparent,
+    // come out transparent; the first and the last lightmap columns are,
+    // so the ones wrapping around from past the edges are as well
+    int x0 = w + 1;
+    int x1 = w + 1;
+    int first = shadingSpans[rt * 2];
+    int end = shadingSpans[rt * 2 + 1];
+    if (first < end) {
+      int firstS = first << 16;
+      int endS = end << 16;
+      x0 = s >= firstS ? 0 : (firstS - s + zv - 1) / zv;
+      x1 = s >= endS ? 0 : (endS - s + zv - 1) / zv;
+      if (x1 > w + 1) x1 = w + 1;
+      if (x0 > x1) x0 = x1;
+    }
+    for (int x = 0; x < x0; ++x) d[x] = 0;
+    sphere::Span span = { u + x0 * cv, v + x0 * sv, s + x0 * zv, cv, sv, zv };
+    sphere::shadeSpan<TEXTURE_COORD_BITS>(d + x0, x1 - x0, span, albedo.pixels,
+        shading + (rt << TEXTURE_COORD_BITS));
+    for (int x = x1; x <= w; ++x) d[x] = 0;
+    d += p;
+    u += -sv;
+    v += cv;
+    t += zv;
+  }
+}
+
+void ShadedSphere::renderReference(PixelBuffer &target, int cx, int cy, int radius, int angle) {
 #ifdef FIXED
   Fixed zoom = Fixed(static_cast<int>(TEXTURE_SIZE >> 1)) / radius;
   int zv = zoom.f;
@@ -282,96 +322,243 @@ void ShadedSphere::render(PixelBuffer &target, int cx, int cy, int radius, int a
   }
 }
 
-int SphereCache::reassign(ShadedSphere *newSphere, int newRadius, bool newOutlier) {
-  if (s == newSphere && radius == newRadius && outlier == newOutlier) return 0;
-  int result = 1;
-  s = newSphere;
-  if (radius != newRadius || outlier != newOutlier) {
-    outlier = newOutlier;
-    radius = newRadius;
-    if (cache) {
-      SDL_FreeSurface(cache);
-      cache = nullptr;
+namespace {
+  /// Finds the spans of the rows of a freshly rendered sprite and
+  /// premultiplies the pixels at the edges, the rest are opaque
+  void encodeSprite(const Sprite &sprite) {
+    PixelBuffer pb(sprite.pixels());
+    for (int y = 0; y < pb.height; ++y) {
+      uint32_t *line = pb.pixels + y * pb.pitch;
+      uint16_t *span = sprite.spans + y * sprite.spanPitch;
+      int left = 0;
+      while (left < pb.width && !(line[left] >> 24)) ++left;
+      int right = pb.width;
+      while (right > left && !(line[right - 1] >> 24)) --right;
+      int opaqueLeft = left;
+      while (opaqueLeft < right && line[opaqueLeft] >> 24 != 0xff) ++opaqueLeft;
+      int opaqueRight = opaqueLeft;
+      while (opaqueRight < right && line[opaqueRight] >> 24 == 0xff) ++opaqueRight;
+      span[0] = left;
+      span[1] = opaqueLeft;
+      span[2] = opaqueRight;
+      span[3] = right;
+      for (int x = left; x < right; ++x) {
+        if (x == opaqueLeft) x = opaqueRight;
+        if (x == right) break;
+        uint32_t alpha = line[x] >> 24;
+        if (alpha != 0xff) line[x] = ablend(line[x], alpha) & 0xffffffu | alpha << 24;
+      }
+    }
+  }
+
+  /// Copies the opaque run of each row and blends the edges,
+  /// clipped to the target
+  void blitSprite(const Sprite &sprite, PixelBuffer target, int x, int y) {
+    PixelBuffer pb(sprite.pixels());
+    int top = y < 0 ? -y : 0;
+    int bottom = min(pb.height, target.height - y);
+    int clipLeft = -x;
+    int clipRight = target.width - x;
+    for (int row = top; row < bottom; ++row) {
+      const uint16_t *span = sprite.spans + row * sprite.spanPitch;
+      const uint32_t *s = pb.pixels + row * pb.pitch;
+      uint32_t *d = target.pixels + (y + row) * target.pitch + x;
+      for (int i = 0; i < 3; ++i) {
+        int from = max<int>(span[i], clipLeft);
+        int to = min<int>(span[i + 1], clipRight);
+        if (to <= from) continue;
+        if (i == 1) {
+          memcpy(d + from, s + from, (to - from) * sizeof(uint32_t));
+        } else {
+          sphere::blendSpan(d + from, s + from, to - from);
+        }
+      }
     }
-    int extra = outlier ? 2 : 0;
-    cache = platform.createSurface(newRadius*2+1+extra, newRadius*2+1+extra);
-#ifdef BITTBOY
-    SDL_SetColorKey(cache, SDL_SRCCOLORKEY, 0);
-#endif
-    result = 2;
   }
-  dirty = true;
-  ++numCacheReassignMisses;
-  return result;
 }
 
-void SphereCache::release() {
-  if (cache) SDL_FreeSurface(cache);
-  cache = nullptr;
-  radius = 0;
-  angle = 0;
-  dirty = true;
+SphereCache::SphereCache(SpriteAtlas &atlas):
+    atlas(atlas),
+    entries(new Entry[maxEntries]),
+    buckets(new int32_t[numBuckets]),
+    firstFree(0),
+    newest(-1),
+    oldest(-1),
+    lastResult(0) {
+  for (int i = 0; i < numBuckets; ++i) {
+    buckets[i] = -1;
+  }
+  for (int i = 0; i < maxEntries; ++i) {
+    entries[i].nextInBucket = i + 1 < maxEntries ? i + 1 : -1;
+  }
 }
 
-SDL_Surface* SphereCache::withAngle(int newAngle) {
-  if (!dirty) {
-    int diff = abs(angle - newAngle);
-    if (diff >= 32768) diff = 65535 - diff;
-    if (diff > 16) dirty = true;
-    if (dirty) {
-      ++numCacheAngleMisses;
-#ifdef DEBUG_VISUALIZATION
-      invalidationReason = 2;
-#endif
+SphereCache::~SphereCache() {
+  while (oldest >= 0) {
+    evict(oldest);
+  }
+  delete[] entries;
+  delete[] buckets;
+}
+
+uint32_t SphereCache::getBucket(uint32_t key) {
+  return key * 2654435761u >> 19;
+}
+
+uint32_t SphereCache::getKey(int kind, int radius, int angle, bool outlier) {
+  int step = getAngleStep(radius);
+  int stepIndex = ((angle + (step >> 1)) & 0xffff) / step;
+  return static_cast<uint32_t>(kind) << 28 | (outlier ? 1u << 27 : 0) |
+      static_cast<uint32_t>(radius) << 15 | stepIndex;
+}
+
+int SphereCache::getAngleStep(int radius) {
+  // a step of 4096 / r units turns the edge 0.4 pixels, the power of two
+  // below that, but at least 32 units, the sprites were already 16 units
+  // off before
+  int step = 32;
+  while (step < 1024 && step * 2 * radius <= 4096) step <<= 1;
+  return step;
+}
+
+void SphereCache::makeNewest(int32_t index) {
+  Entry &e(entries[index]);
+  e.older = newest;
+  e.newer = -1;
+  if (newest >= 0) entries[newest].newer = index; else oldest = index;
+  newest = index;
+}
+
+void SphereCache::unlink(int32_t index) {
+  Entry &e(entries[index]);
+  if (e.older >= 0) entries[e.older].newer = e.newer; else oldest = e.newer;
+  if (e.newer >= 0) entries[e.newer].older = e.older; else newest = e.older;
+}
+
+void SphereCache::evict(int32_t index) {
+  Entry &e(entries[index]);
+  unlink(index);
+  int32_t *link = buckets + getBucket(e.key);
+  while (*link != index) link = &entries[*link].nextInBucket;
+  *link = e.nextInBucket;
+  if (e.cell >= 0) atlas.release(e.cell);
+  e.nextInBucket = firstFree;
+  firstFree = index;
+  ++numCacheEvictions;
+}
+
+int SphereCache::allocate(int size, Sprite &sprite) {
+  if (!atlas.fits(size)) {
+    atlas.getScratch(size, sprite);
+    return -1;
+  }
+  int cell = atlas.allocate(size, sprite);
+  if (cell >= 0) return cell;
+  // a sprite of the same class gives its cell right away
+  int sizeClass = SpriteAtlas::getSizeClass(size);
+  int32_t index = oldest;
+  for (int i = 0; index >= 0 && i < maxSearch; ++i) {
+    if (SpriteAtlas::getSizeClass(entries[index].sprite.rect.w) == sizeClass) {
+      evict(index);
+      return atlas.allocate(size, sprite);
     }
-  } else {
-#ifdef DEBUG_VISUALIZATION
-    invalidationReason = 1;
-#endif
+    index = entries[index].newer;
   }
-  if (dirty) {
-    ++numCacheMisses;
-    angle = newAngle;
-
-    SurfaceLocker lock(cache);
-
-    PixelBuffer &pb(lock.pb);
-    int offset = outlier ? 1 : 0;
-    s->render(pb, radius+offset, radius+offset, radius, angle & 0xffff);
-    if (outlier) {
-      uint32_t *line  = pb.pixels + pb.pitch + 1;
-      int h = pb.height - 2;
-      int w = pb.width - 2;
-      for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-          uint32_t col = line[x];
-          uint32_t a = line[x - pb.pitch];
-          uint32_t b = line[x + pb.pitch];
-          uint32_t c = line[x - 1];
-          uint32_t d = line[x + 1];
-          if ((a & 0xFFFFFFu) != 0xFFFFFFu && (col & 0xFF000000u) < (a & 0xFF000000u)) {
-            line[x] = col + a | 0xFFFFFFu;
-          } else if ((b & 0xFFFFFFu) != 0xFFFFFFu && (col & 0xFF000000u) < (b & 0xFF000000u)) {
-            line[x] = col + b | 0xFFFFFFu;
-          } else if ((c & 0xFFFFFFu) != 0xFFFFFFu && (col & 0xFF000000u) < (c & 0xFF000000u)) {
-            line[x] = col + c | 0xFFFFFFu;
-          } else if ((d & 0xFFFFFFu) != 0xFFFFFFu && (col & 0xFF000000u) < (d & 0xFF000000u)) {
-            line[x] = col + d | 0xFFFFFFu;
-          }
+  // the others only help once a whole shelf is empty
+  while (cell < 0 && oldest >= 0) {
+    evict(oldest);
+    cell = atlas.allocate(size, sprite);
+  }
+  return cell;
+}
+
+void SphereCache::render(ShadedSphere *s, const Sprite &sprite, int radius, int angle, bool outlier) {
+  SurfaceLocker lock(sprite.page);
+
+  PixelBuffer pb(sprite.pixels());
+  int offset = outlier ? 1 : 0;
+  if (outlier) {
+    // the cell may have held another sprite, the sphere leaves the border alone
+    for (int y = 0; y < pb.height; ++y) {
+      memset(pb.pixels + y * pb.pitch, 0, pb.width * sizeof(uint32_t));
+    }
+  }
+  s->render(pb, radius+offset, radius+offset, radius, angle & 0xffff);
+  if (outlier) {
+    uint32_t *line  = pb.pixels + pb.pitch + 1;
+    int h = pb.height - 2;
+    int w = pb.width - 2;
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        uint32_t col = line[x];
+        uint32_t a = line[x - pb.pitch];
+        uint32_t b = line[x + pb.pitch];
+        uint32_t c = line[x - 1];
+        uint32_t d = line[x + 1];
+        if ((a & 0xFFFFFFu) != 0xFFFFFFu && (col & 0xFF000000u) < (a & 0xFF000000u)) {
+          line[x] = col + a | 0xFFFFFFu;
+        } else if ((b & 0xFFFFFFu) != 0xFFFFFFu && (col & 0xFF000000u) < (b & 0xFF000000u)) {
+          line[x] = col + b | 0xFFFFFFu;
+        } else if ((c & 0xFFFFFFu) != 0xFFFFFFu && (col & 0xFF000000u) < (c & 0xFF000000u)) {
+          line[x] = col + c | 0xFFFFFFu;
+        } else if ((d & 0xFFFFFFu) != 0xFFFFFFu && (col & 0xFF000000u) < (d & 0xFF000000u)) {
+          line[x] = col + d | 0xFFFFFFu;
         }
-        line += pb.pitch;
       }
+      line += pb.pitch;
     }
+  }
+  encodeSprite(sprite);
 
-    lock.unlock();
-    dirty = false;
-  } else {
-#ifdef DEBUG_VISUALIZATION
-    invalidationReason = 0;
-#endif
-    ++numCacheHits;
+  lock.unlock();
+}
+
+const Sprite& SphereCache::get(ShadedSphere *s, int kind, int radius, int angle, bool outlier, int id) {
+  int size = getSize(radius, outlier);
+  uint32_t key = getKey(kind, radius, angle, outlier);
+  // rounded to the step of the key
+  angle = (key & 0x7fff) * getAngleStep(radius);
+  int32_t *bucket = buckets + getBucket(key);
+  if (radius <= maxRadius) {
+    for (int32_t i = *bucket; i >= 0; i = entries[i].nextInBucket) {
+      Entry &e(entries[i]);
+      if (e.key != key) continue;
+      unlink(i);
+      makeNewest(i);
+      ++numCacheHits;
+      if (e.owner != id) {
+        ++numCacheSharedHits;
+        lastResult = 2;
+      } else {
+        lastResult = 0;
+      }
+      return e.sprite;
+    }
+  }
+  ++numCacheMisses;
+  lastResult = 1;
+  Sprite sprite;
+  int cell = radius <= maxRadius ? allocate(size, sprite) : -1;
+  if (cell < 0) {
+    // rendered again the next time
+    if (radius > maxRadius) atlas.getScratch(size, sprite);
+    scratch = sprite;
+    render(s, scratch, radius, angle, outlier);
+    return scratch;
   }
-  return cache;
+  if (firstFree < 0) evict(oldest);
+  int32_t index = firstFree;
+  Entry &e(entries[index]);
+  firstFree = e.nextInBucket;
+  e.key = key;
+  e.cell = cell;
+  e.sprite = sprite;
+  e.owner = id;
+  e.nextInBucket = *bucket;
+  *bucket = index;
+  makeNewest(index);
+  render(s, e.sprite, radius, angle, outlier);
+  return e.sprite;
 }
 
 static const char * const imageNames[] = {
@@ -530,16 +717,35 @@ void FruitRenderer::addTime() {
 }
 
 FruitRenderer::FruitRenderer(SDL_Surface *target):
+    atlas(atlasPageSize, atlasBudget),
+    spheres(atlas),
     target(target),
-    numSpheres(0),
+    maxNumFruits(0),
+    above(nullptr),
+    drawnPlanets(nullptr),
+    lastDrawnPlanets(nullptr),
+    numDrawnPlanets(0),
+    numLastDrawnPlanets(0),
+    lastDrawnIndex(nullptr),
+    compositing(false),
+    invalidated(true),
+    background(nullptr),
     highscoreCache("High score"),
     fps(-1),
     performanceCounts { },
     performanceSnapshots { },
     perfIndex(0),
     menuButtonAlpha(0),
-    menuButtonHover(0) {
+    menuButtonHover(0),
+    showLanding(false),
+    landingMerges(false) {
   ShadedSphere::initTables();
+  reserveFruits(defaultFruitCap);
+  damage.reset(target->w, target->h);
+  for (int i = 0; i < numLayers; ++i) {
+    layers[i].shown = false;
+    lastLayers[i].shown = false;
+  }
 
   numTextures = (sizeof(imageNames) / sizeof(*imageNames)) - 1;
   textures = new SDL_Surface*[numTextures];
@@ -646,6 +852,8 @@ FruitRenderer::FruitRenderer(SDL_Surface *target):
   shading = new uint32_t[TEXTURE_SIZE*TEXTURE_SIZE];
   PixelBuffer pb(TEXTURE_SIZE, TEXTURE_SIZE, TEXTURE_SIZE, shading);
   renderSphereLightmap(pb);
+  shadingSpans = new uint16_t[TEXTURE_SIZE*2];
+  ShadedSphere::findSpans(pb, shadingSpans);
 
   drawProgressbar(target, currentStep++, numSteps);
   sphereDefs = new ShadedSphere[numTextures];
@@ -653,6 +861,7 @@ FruitRenderer::FruitRenderer(SDL_Surface *target):
     ShadedSphere &s(sphereDefs[i]);
     s.albedo = textures[i];
     s.shading = shading;
+    s.shadingSpans = shadingSpans;
   }
 
   drawProgressbar(target, currentStep++, numSteps);
@@ -684,8 +893,33 @@ FruitRenderer::~FruitRenderer() {
   textures = nullptr;
   numTextures = 0;
   delete[] shading;
+  delete[] shadingSpans;
   delete[] sphereDefs;
   sphereDefs = nullptr;
+  delete[] above;
+  delete[] drawnPlanets;
+  delete[] lastDrawnPlanets;
+  delete[] lastDrawnIndex;
+}
+
+void FruitRenderer::reserveFruits(int newMaxNumFruits) {
+  if (newMaxNumFruits <= maxNumFruits) return;
+  delete[] above;
+  delete[] drawnPlanets;
+  delete[] lastDrawnPlanets;
+  delete[] lastDrawnIndex;
+  maxNumFruits = newMaxNumFruits;
+  above = new int32_t[maxNumFruits];
+  // and one for the next planet
+  drawnPlanets = new DrawnPlanet[maxNumFruits + 1];
+  lastDrawnPlanets = new DrawnPlanet[maxNumFruits + 1];
+  numDrawnPlanets = 0;
+  numLastDrawnPlanets = 0;
+  lastDrawnIndex = new int32_t[maxNumFruits];
+  for (int i = 0; i < maxNumFruits; ++i) {
+    lastDrawnIndex[i] = -1;
+  }
+  invalidate();
 }
 
 void FruitRenderer::dumpTimes() {
@@ -832,6 +1066,8 @@ void FruitRenderer::renderMenuScores(int score, int highscore) {
 }
 
 void FruitRenderer::renderBackground(SDL_Surface *background) {
+  this->background = background;
+  invalidate();
   // Render gallery
   int radius = zoom * 7 / 12;
   int realRadius = zoom * 2 / 3;
@@ -868,26 +1104,23 @@ void FruitRenderer::renderBackground(SDL_Surface *background) {
   }
   b.unlock();
   for (int i = 0; i < numRadii; ++i) {
-    SphereCache &sc(spheres[i]);
-    sc.reassign(sphereDefs + i, realRadius);
-    SDL_Surface *s = sc.withAngle(0);
+    const Sprite &s(spheres.get(sphereDefs + i, i, realRadius, 0, false, -1));
     int y = galleryTop + i * step;
-    SDL_Rect dst;
-    dst.x = static_cast<Sint16>(planetLeft);
-    dst.y = static_cast<Sint16>(y+1);
-    SDL_BlitSurface(s, nullptr, background, &dst);
+    SurfaceLocker gallery(background);
+    blitSprite(s, gallery.pb, planetLeft, y+1);
+    gallery.unlock();
 
     PlanetDefinition &def(planetDefs[i]);
     Placement &plc(def.placement);
     plc.x = planetLeft;
     plc.y = y;
-    plc.w = s->w;
-    plc.h = s->h;
+    plc.w = s.rect.w;
+    plc.h = s.rect.h;
 
     SDL_Surface *text = def.nameText;
     if (text) {
-      dst.x = static_cast<Sint16>(planetLeft - text->w - (radius + 1) / 2);
-      dst.y = static_cast<Sint16>(y + radius - text->h * 9 / 16 + fontSize / 8);
+      SDL_Rect dst = makeRect(planetLeft - text->w - (radius + 1) / 2,
+          y + radius - text->h * 9 / 16 + fontSize / 8);
       SDL_BlitSurface(text, nullptr, background, &dst);
     }
   }
@@ -945,48 +1178,6 @@ void FruitRenderer::renderBackground(SDL_Surface *background) {
     }
   }
   lock.unlock();
-  // these caches won't be needed anymore
-  for (int i = 0; i < numRadii; ++i) {
-    spheres[i].release();
-  }
-}
-
-void quickBlit(PixelBuffer src, PixelBuffer dst, int x, int y) {
-  int w = src.width;
-  int h = src.height;
-  uint32_t *s = src.pixels;
-  if (x < 0) {
-    w += x;
-    s -= x;
-    x = 0;
-  }
-  if (y < 0) {
-    h += y;
-    s -= y * src.pitch;
-    y = 0;
-  }
-  if (x + w > dst.width) {
-    w = dst.width - x;
-  }
-  if (y + h > dst.height) {
-    h = dst.height - y;
-  }
-  if (w <= 0 || h <= 0) return;
-  if (x < 0 || y < 0) {
-    return;
-  }
-  uint32_t *d = dst.pixels + x + y * dst.pitch;
-  for (int py = 0; py < h; ++py) {
-    uint32_t *dl = d;
-    uint32_t *sl = s;
-    for (int px = 0; px < w; ++px) {
-      uint32_t col = *sl++;
-      if (col) *dl = col;
-      ++dl;
-    }
-    d += dst.pitch;
-    s += src.pitch;
-  }
 }
 
 void FruitRenderer::renderSelection(PixelBuffer pb, int left, int top, int right, int bottom, int shift, bool hollow) {
@@ -1006,127 +1197,284 @@ void FruitRenderer::renderSelection(PixelBuffer pb, int left, int top, int right
   }
 }
 
-void FruitRenderer::renderFruits(FruitSim &sim, int count, int selection, int outlierIndex, uint32_t frameIndex, Scalar frameFraction, bool skipScore) {
+void FruitRenderer::findDamage() {
+  if (!compositing || invalidated) {
+    damage.addAll();
+  } else {
+    damage.clear();
+  }
+  for (int i = 0; i < numLayers; ++i) {
+    const Layer &l(layers[i]);
+    const Layer &last(lastLayers[i]);
+    if (l.shown == last.shown && (!l.shown || (sameRect(l.box, last.box) && l.look == last.look))) continue;
+    if (last.shown) damage.add(last.box);
+    if (l.shown) damage.add(l.box);
+  }
+  for (int i = 0; i < numLastDrawnPlanets; ++i) {
+    lastDrawnIndex[lastDrawnPlanets[i].id] = i;
+  }
+  for (int i = 0; i < numDrawnPlanets; ++i) {
+    const DrawnPlanet &p(drawnPlanets[i]);
+    int32_t index = lastDrawnIndex[p.id];
+    if (index >= 0) {
+      // a second planet with the same id counts as a new one
+      lastDrawnIndex[p.id] = -1;
+      DrawnPlanet &last(lastDrawnPlanets[index]);
+      last.id = -1;
+      if (sameRect(p.box, last.box) && p.look == last.look) continue;
+      damage.add(last.box);
+    }
+    damage.add(p.box);
+  }
+  // the ones left weren't drawn again, merged or off the screen
+  for (int i = 0; i < numLastDrawnPlanets; ++i) {
+    const DrawnPlanet &last(lastDrawnPlanets[i]);
+    if (last.id < 0) continue;
+    lastDrawnIndex[last.id] = -1;
+    damage.add(last.box);
+  }
+}
+
+void FruitRenderer::renderFruits(FruitSim &sim, int count, int selection, int outlierId, uint32_t frameIndex, Scalar frameFraction, bool skipScore) {
   performance.reset();
   perfIndex = 0;
   Fruit *fruits = sim.getFruits();
   Scalar remainingFraction = Scalar(1) - frameFraction;
+  reserveFruits(sim.getMaxNumFruits());
+#ifdef DEBUG_VISUALIZATION
+  // the cache results aren't tracked
+  invalidate();
+#endif
+  for (int i = 0; i < numLayers; ++i) {
+    lastLayers[i] = layers[i];
+    layers[i].shown = false;
+  }
+  DrawnPlanet *drawn = lastDrawnPlanets;
+  lastDrawnPlanets = drawnPlanets;
+  numLastDrawnPlanets = numDrawnPlanets;
+  drawnPlanets = drawn;
+  numDrawnPlanets = 0;
+
+  // Find what is on the screen first, only the damage is drawn
+  SDL_Surface *scoreText = nullptr;
   if (!skipScore) {
     int score = sim.getScore();
-    SDL_Surface *scoreText = scoreCache.render(score);
+    scoreText = scoreCache.render(score);
     if (scoreText) {
-      SDL_Rect scorePos {
-        .x = static_cast<Sint16>(static_cast<int>(offsetX-scoreText->w) >> 1),
-        .y = static_cast<Sint16>((planetDefs[0].placement.y * 7 / 8 - scoreText->h) >> 1),
-      };
-      SDL_BlitSurface(scoreText, nullptr, target, &scorePos);
+      Layer &l(layers[scoreLayer]);
+      l.box = makeRect(static_cast<int>(offsetX-scoreText->w) >> 1,
+          (planetDefs[0].placement.y * 7 / 8 - scoreText->h) >> 1,
+          scoreText->w, scoreText->h);
+      l.look = score;
+      l.shown = true;
     }
   }
-  // 0..
-  addTime();
-  // Render selection
   if (selection >= 0 && selection < numRadii) {
     Placement &def(planetDefs[selection].placement);
-    SDL_Rect rect {
-      .x = static_cast<Sint16>(def.x + def.w + 2),
-      .y = static_cast<Sint16>(def.y + def.h / 8),
-      .w = 4,
-      .h = static_cast<Uint16>(def.h * 6 / 8),
-    };
-    int top = rect.y;
-    int bottom = rect.y + rect.h;
-    int left = 0;
-    int right = def.x;
-
-    SurfaceLocker targetLock(target);
-    PixelBuffer &pb(targetLock.pb);
-    renderSelection(pb, left, top, right, bottom, 2);
-    targetLock.unlock();
+    int top = def.y + def.h / 8;
+    Layer &l(layers[selectionLayer]);
+    // the selection reads the pixels two to the right
+    l.box = makeRect(0, top, def.x + 2, def.h * 6 / 8);
+    l.look = selection;
+    l.shown = true;
   }
-  // 1..
-  addTime();
 
   int bottom = target->h;
   int top = bottom - sizeY * zoom;
 
-  // Render drop line
+  int dropAlpha = showLanding && landingMerges ? 0x80 : 0x40;
   if (sim.getNumFruits() < count) {
-    SurfaceLocker lock(target);
     const Fruit &f(fruits[count - 1]);
     Point interpolatedPos = f.pos + (f.lastPos - f.pos) * remainingFraction;
     int x = interpolatedPos.x * zoom + offsetX;
     int startY = interpolatedPos.y * zoom + top;
-    uint32_t *p = lock.pb.pixels + x + startY * lock.pb.pitch;
-
-    int alpha = 0x40;
-    uint32_t premultiplied = alpha | (alpha << 8) | (alpha << 16);
-    alpha = 0xFF - alpha;
-    for (int y = startY; y < target->h; ++y) {
-      *p = ablend(*p, alpha) + premultiplied;
-      p += lock.pb.pitch;
+    int endY = target->h;
+    if (showLanding) {
+      int landingY = landing.y * zoom + top;
+      if (landingY > startY && landingY < endY) endY = landingY;
+    }
+    Layer &line(layers[dropLineLayer]);
+    line.box = makeRect(x, startY, 1, endY - startY);
+    line.look = dropAlpha;
+    line.shown = endY > startY;
+    if (endY < target->h) {
+      // a mark as wide as the planet where it comes to rest
+      int left = (landing.x - landingRadius) * zoom + offsetX;
+      int right = (landing.x + landingRadius) * zoom + offsetX;
+      if (left < 0) left = 0;
+      if (right > target->w) right = target->w;
+      Layer &mark(layers[landingMarkLayer]);
+      mark.box = makeRect(left, endY, right - left, 1);
+      mark.look = dropAlpha;
+      mark.shown = right > left;
     }
   }
-  // 2..
-  addTime();
 
-#ifdef USE_QUICKBLIT
-  SurfaceLocker sl(target);
-#endif
-  // Render playfield
-  int32_t above[fruitCap];
   int numAbove = 0;
   for (int i = 0; i < count; ++i) {
     int index = i == 0 ? count - 1 : i - 1;
     Fruit &f(fruits[index]);
-    SphereCache &sc(spheres[index + numRadii]);
+    int id = f.id();
     int radius = f.r * zoom;
-    int reassignResult = sc.reassign(sphereDefs + f.rIndex, radius, index == outlierIndex);
-    SDL_Surface *s = sc.withAngle((-f.rotation) & 0xffff);
-    SDL_Rect dst;
-#ifdef DEBUG_VISUALIZATION
-    int invReason = sc.getInvalidationReason();
-    bool grounded = f.bottomTouchFrame == frameIndex;
-    if (invReason || reassignResult || grounded) {
-      dst.x = static_cast<Sint16>(f.pos.x * zoom - radius + offsetX);
-      dst.y = static_cast<Sint16>(f.pos.y * zoom - radius);
-      dst.h = dst.w = radius << 1;
-      uint32_t color = invReason * 0x7F | reassignResult * 0x7F00 | (grounded ? 0xFF0000 : 0) | 0xFF000000u;
-      SDL_FillRect(target, &dst, color);
-      memset(&dst, 0, sizeof(dst));
-    }
-#endif
+    bool outlier = id == outlierId;
+    int size = SphereCache::getSize(radius, outlier);
     Point interpolatedPos = f.pos + (f.lastPos - f.pos) * remainingFraction;
     int screenX = interpolatedPos.x * zoom - radius + offsetX;
     int screenY = interpolatedPos.y * zoom - radius + top;
-    if (screenY < -s->h) {
-      if (screenY < -32768) screenY = -32768;
-      above[numAbove++] = static_cast<uint32_t>(screenY) << 16 | (screenX & 0xFFFF);
+    if (screenY < -size) {
+      int iconSize = 3 + (-screenY / 2 * zoom / target->h);
+      if (iconSize > 16) iconSize = 16;
+      above[numAbove++] = iconSize << 16 | (screenX & 0xFFFF);
     } else {
-#ifdef USE_QUICKBLIT
-      quickBlit(s, sl.pb, screenX, screenY);
-#else
-      dst.x = static_cast<Sint16>(screenX);
-      dst.y = static_cast<Sint16>(screenY);
-      SDL_BlitSurface(s, nullptr, target, &dst);
+      DrawnPlanet &p(drawnPlanets[numDrawnPlanets++]);
+      p.box = makeRect(screenX, screenY, size, size);
+      p.id = id;
+      p.kind = f.rIndex;
+      p.radius = radius;
+      p.angle = (-f.rotation) & 0xffff;
+      p.outlier = outlier;
+      p.look = SphereCache::getKey(p.kind, radius, p.angle, outlier);
+#ifdef DEBUG_VISUALIZATION
+      p.grounded = f.bottomTouchFrame == frameIndex;
 #endif
     }
   }
-#ifdef USE_QUICKBLIT
-  sl.unlock();
+  if (numAbove) {
+    Layer &l(layers[arrowsLayer]);
+    int left = 0;
+    int right = 0;
+    int height = 0;
+    l.look = 0;
+    for (int i = 0; i < numAbove; ++i) {
+      int32_t v = above[i];
+      int fx = v & 0xFFFF;
+      int iconSize = v >> 16;
+      if (!i || fx - (iconSize >> 1) < left) left = fx - (iconSize >> 1);
+      if (!i || fx + (iconSize >> 1) + 1 > right) right = fx + (iconSize >> 1) + 1;
+      if (iconSize > height) height = iconSize;
+      l.look = l.look * 2654435761u + v;
+    }
+    l.box = makeRect(left, 0, right - left, height);
+    l.shown = true;
+  }
+  if (menuButtonAlpha) {
+    Layer &l(layers[menuButtonLayer]);
+    // the lowest row of the button is just below its placement
+    l.box = makeRect(menuButtonPlacement.x, menuButtonPlacement.y,
+        menuButtonPlacement.w, menuButtonPlacement.h + 1);
+    l.look = menuButtonAlpha | menuButtonHover << 8;
+    l.shown = true;
+  }
+  char fpsText[32];
+  if (fps >= 0) {
+    int length = snprintf(fpsText, sizeof(fpsText), "%d", fps);
+    fpsText[sizeof(fpsText)-1] = 0;
+    Layer &l(layers[fpsLayer]);
+    l.box = makeRect(2, 2, length * 8, 10);
+    l.look = fps;
+    l.shown = true;
+  }
+
+  findDamage();
+  invalidated = false;
+  // the layers damaged anywhere are drawn whole
+  bool redraw[numLayers];
+  for (int i = 0; i < numLayers; ++i) {
+    redraw[i] = false;
+  }
+  bool grown = true;
+  while (grown) {
+    grown = false;
+    for (int i = 0; i < numLayers; ++i) {
+      if (!layers[i].shown || redraw[i] || !damage.intersects(layers[i].box)) continue;
+      damage.add(layers[i].box);
+      redraw[i] = true;
+      grown = true;
+    }
+  }
+  const SDL_Rect *rects = damage.getRects();
+  int numRects = damage.getNumRects();
+  for (int i = 0; i < numRects; ++i) {
+    SDL_Rect src = rects[i];
+    SDL_Rect dst = rects[i];
+    SDL_BlitSurface(background, &src, target, &dst);
+  }
+
+  if (redraw[scoreLayer]) {
+    SDL_Rect scorePos = layers[scoreLayer].box;
+    SDL_BlitSurface(scoreText, nullptr, target, &scorePos);
+  }
+  // 0..
+  addTime();
+  // Render selection
+  if (redraw[selectionLayer]) {
+    const SDL_Rect &box(layers[selectionLayer].box);
+    SurfaceLocker targetLock(target);
+    PixelBuffer &pb(targetLock.pb);
+    renderSelection(pb, 0, box.y, box.w - 2, box.y + box.h, 2);
+    targetLock.unlock();
+  }
+  // 1..
+  addTime();
+
+  // Render drop line
+  if (redraw[dropLineLayer] || redraw[landingMarkLayer]) {
+    SurfaceLocker lock(target);
+    uint32_t premultiplied = dropAlpha | (dropAlpha << 8) | (dropAlpha << 16);
+    int alpha = 0xFF - dropAlpha;
+    if (redraw[dropLineLayer]) {
+      const SDL_Rect &box(layers[dropLineLayer].box);
+      uint32_t *p = lock.pb.pixels + box.x + box.y * lock.pb.pitch;
+      for (int y = 0; y < box.h; ++y) {
+        *p = ablend(*p, alpha) + premultiplied;
+        p += lock.pb.pitch;
+      }
+    }
+    if (redraw[landingMarkLayer]) {
+      const SDL_Rect &box(layers[landingMarkLayer].box);
+      uint32_t *line = lock.pb.pixels + box.y * lock.pb.pitch + box.x;
+      for (int lx = 0; lx < box.w; ++lx) {
+        line[lx] = ablend(line[lx], alpha) + premultiplied;
+      }
+    }
+  }
+  // 2..
+  addTime();
+
+  SurfaceLocker sl(target);
+  // Render playfield, clipped to the damage, so the planets overlapping
+  // another rectangle aren't blended twice there
+  for (int i = 0; i < numDrawnPlanets; ++i) {
+    const DrawnPlanet &p(drawnPlanets[i]);
+    if (!damage.intersects(p.box)) continue;
+    const Sprite &s(spheres.get(sphereDefs + p.kind, p.kind, p.radius, p.angle, p.outlier, p.id));
+#ifdef DEBUG_VISUALIZATION
+    int cacheResult = spheres.getLastResult();
+    if (cacheResult || p.grounded) {
+      SDL_Rect dst = p.box;
+      dst.h = dst.w = p.radius << 1;
+      uint32_t color = (cacheResult == 1 ? 0x7F : 0) | (cacheResult == 2 ? 0x7F00 : 0) | (p.grounded ? 0xFF0000 : 0) | 0xFF000000u;
+      SDL_FillRect(target, &dst, color);
+    }
 #endif
+    for (int j = 0; j < numRects; ++j) {
+      const SDL_Rect &r(rects[j]);
+      if (!rectsIntersect(r, p.box)) continue;
+      blitSprite(s, sl.pb.cropped(r.x, r.y, r.x + r.w, r.y + r.h), p.box.x - r.x, p.box.y - r.y);
+    }
+  }
+  sl.unlock();
   // 3..
   addTime();
 
-  if (numAbove) {
+  if (redraw[arrowsLayer]) {
     // Draw arrows (triangles) for objects above the screen
     SurfaceLocker lock(target);
     PixelBuffer pb(lock.pb);
     for (int i = 0; i < numAbove; ++i) {
       int32_t v = above[i];
       int fx = v & 0xFFFF;
-      int fy = v >> 16;
-      int iconSize = 3 + (-fy / 2 * zoom / target->h);
-      if (iconSize > 16) iconSize = 16;
+      int iconSize = v >> 16;
       for (int y = 0; y < iconSize; ++y) {
         uint32_t *line = pb.pixels + pb.pitch * y;
         int size = (y >> 1)*2 + 1;
@@ -1140,29 +1488,21 @@ void FruitRenderer::renderFruits(FruitSim &sim, int count, int selection, int ou
   // 4..
   addTime();
 
-  SurfaceLocker locker(target);
-  renderCommonOverlay(locker.pb);
-  locker.unlock();
+  if (redraw[menuButtonLayer]) {
+    SurfaceLocker locker(target);
+    renderCommonOverlay(locker.pb);
+    locker.unlock();
+  }
 
-  if (fps >= 0) {
-    char c[32];
-    snprintf(c, sizeof(c), "%d", fps);
-    c[sizeof(c)-1] = 0;
+  if (redraw[fpsLayer]) {
     SurfaceLocker lock(target);
     uint32_t *base = lock.pb.pixels + 2 * (1 + lock.pb.pitch);
-    for (int i = 0; i < sizeof(c) && c[i]; ++i) {
+    for (int i = 0; i < sizeof(fpsText) && fpsText[i]; ++i) {
       uint32_t *p = base + i * 8;
-      writeDigit(p, lock.pb.pitch, (c[i] - '0')%10, 0xFFFFFFFFu, 0xFF000000u);
+      writeDigit(p, lock.pb.pitch, (fpsText[i] - '0')%10, 0xFFFFFFFFu, 0xFF000000u);
     }
   }
 
   // 5..
   addTime();
-
-  for (int i = count; i < numSpheres; ++i) {
-    spheres[i + numRadii].release();
-  }
-  numSpheres = count;
-  // 6..
-  addTime();
 }
@@ -3,6 +3,8 @@
 #include <stdint.h>
 
 #include "platform.hh"
+#include "atlas.hh"
+#include "damage.hh"
 #include "util.hh"
 #include "../common/sim.hh"
 
@@ -20,46 +22,101 @@ template <typename T> T clamp(T min, T max, T val) {
   return val;
 }
 
+#if defined(BITTBOY) || defined(LOREZ)
+const unsigned TEXTURE_COORD_BITS = 7;
+#else
+const unsigned TEXTURE_COORD_BITS = 9;
+#endif
+
+const unsigned TEXTURE_SIZE = 1 << TEXTURE_COORD_BITS;
+const unsigned TEXTURE_COORD_MASK = TEXTURE_SIZE - 1;
+
+void renderSphereLightmap(PixelBuffer &pb);
+
 struct ShadedSphere {
   PixelBuffer albedo;
   uint32_t *shading;
+  /// The first texel and the one past the last texel of each lightmap
+  /// row that isn't transparent, see findSpans
+  const uint16_t *shadingSpans;
 
   static void initTables();
+  /// Stores two numbers for each row of the lightmap into spans
+  static void findSpans(const PixelBuffer &lightmap, uint16_t *spans);
+  /// Only shades the pixels that fall inside the spans of the lightmap,
+  /// the rest are transparent, with the sphere kernel of the platform
   void render(PixelBuffer &target, int cx, int cy, int radius, int angle);
+  /// Shades every pixel one by one, render gives the same pixels
+  void renderReference(PixelBuffer &target, int cx, int cy, int radius, int angle);
 };
 
+/// The sprites of the planets, shared by all the planets of the same
+/// kind, size and about the same rotation. The rotation is rounded to
+/// steps moving the edge of the sphere less than half a pixel, the
+/// sprites used the longest time ago give way when the atlas is full.
 class SphereCache {
-  ShadedSphere *s;
-  SDL_Surface *cache;
-  int radius;
-  int angle;
-  bool outlier;
-  bool dirty;
-#ifdef DEBUG_VISUALIZATION
-  int invalidationReason;
-#endif
-  friend class FruitRenderer;
+  static const int maxEntries = 4096;
+  /// A power of two, getBucket keeps the upper 13 bits of the hash
+  static const int numBuckets = 8192;
+  static const int maxRadius = 4095;
+  /// How far from the oldest sprite a full atlas looks for one of the
+  /// same size class to evict
+  static const int maxSearch = 64;
+
+  struct Entry {
+    /// The kind, the outlier flag, the radius and the rotation step
+    uint32_t key;
+    int cell;
+    Sprite sprite;
+    /// The fruit the sprite was rendered for
+    int owner;
+    int32_t nextInBucket;
+    /// Toward the ones used earlier, and later
+    int32_t older, newer;
+  };
+
+  SpriteAtlas &atlas;
+  Entry *entries;
+  int32_t *buckets;
+  /// The free entries are linked by nextInBucket
+  int32_t firstFree;
+  int32_t newest, oldest;
+  Sprite scratch;
+  int lastResult;
 
+  static uint32_t getBucket(uint32_t key);
+  static int getAngleStep(int radius);
+  void makeNewest(int32_t index);
+  void unlink(int32_t index);
+  void evict(int32_t index);
+  /// Finds a cell for the sprite, evicting others as needed
+  int allocate(int size, Sprite &sprite);
+  static void render(ShadedSphere *s, const Sprite &sprite, int radius, int angle, bool outlier);
 public:
   static int numCacheHits;
+  static int numCacheSharedHits;
   static int numCacheMisses;
-  static int numCacheAngleMisses;
-  static int numCacheReassignMisses;
+  static int numCacheEvictions;
 
-  inline SphereCache(): s(nullptr), cache(nullptr), radius(0), angle(0), dirty(false), outlier(false) { }
+  explicit SphereCache(SpriteAtlas &atlas);
+  ~SphereCache();
 
-  void release();
+  /// The same for all the planets sharing a sprite, without rendering it
+  static uint32_t getKey(int kind, int radius, int angle, bool outlier);
 
-  inline ~SphereCache() {
-    release();
+  /// The width and height of the sprite
+  inline static int getSize(int radius, bool outlier) {
+    return radius * 2 + 1 + (outlier ? 2 : 0);
   }
 
-  int reassign(ShadedSphere *newSphere, int newRadius, bool outlier = false);
-  SDL_Surface* withAngle(int newAngle);
+  /// The sprite of a planet of the kind, rendered for the fruit with
+  /// the id, or any other; it stays valid until the next call
+  const Sprite& get(ShadedSphere *s, int kind, int radius, int angle, bool outlier, int id);
 
 #ifdef DEBUG_VISUALIZATION
-  int getInvalidationReason() {
-    return invalidationReason;
+  /// 0 for a hit, 1 for a miss, 2 for a sprite shared with another fruit
+  inline int getLastResult() const {
+    return lastResult;
   }
 #endif
 };
@@ -109,13 +166,70 @@ struct PlanetDefinition {
 void blur(SDL_Surface *s, int frame);
 
 class FruitRenderer {
+  /// The things drawn over the background besides the planets, each of
+  /// them is drawn whole once any part of it is damaged
+  enum {
+    scoreLayer,
+    selectionLayer,
+    dropLineLayer,
+    landingMarkLayer,
+    arrowsLayer,
+    menuButtonLayer,
+    fpsLayer,
+    numLayers,
+  };
+
+  struct Layer {
+    SDL_Rect box;
+    /// Changes whenever it looks different inside the same box
+    uint32_t look;
+    bool shown;
+  };
+
+  struct DrawnPlanet {
+    /// Where the whole sprite goes, it may be partly off the screen
+    SDL_Rect box;
+    /// The key of the sprite in the sphere cache
+    uint32_t look;
+    int id;
+    int kind;
+    int radius;
+    int angle;
+    bool outlier;
+#ifdef DEBUG_VISUALIZATION
+    bool grounded;
+#endif
+  };
+
   SDL_Surface **textures;
   PlanetDefinition planetDefs[numRadii];
   int numTextures;
   uint32_t *shading;
-  SphereCache spheres[fruitCap + numRadii];
-  int numSpheres;
+  uint16_t *shadingSpans;
   ShadedSphere *sphereDefs;
+  /// The sprites of the sphere cache
+  SpriteAtlas atlas;
+  SphereCache spheres;
+  int maxNumFruits;
+  /// The fruits above the screen
+  int32_t *above;
+  Layer layers[numLayers];
+  Layer lastLayers[numLayers];
+  /// The planets of this frame and of the last one drawn
+  DrawnPlanet *drawnPlanets;
+  DrawnPlanet *lastDrawnPlanets;
+  int numDrawnPlanets;
+  int numLastDrawnPlanets;
+  /// Where each fruit id is in lastDrawnPlanets, -1 if it isn't there
+  int32_t *lastDrawnIndex;
+  /// The parts of the target drawn again in the last renderFruits
+  Damage damage;
+  /// Whether the last frame stays on the target, so only the damage has
+  /// to be drawn again
+  bool compositing;
+  bool invalidated;
+  /// Restores the damaged parts of the target, see renderBackground
+  SDL_Surface *background;
   SDL_Surface *target;
   Scalar zoom;
   Scalar offsetX;
@@ -128,6 +242,11 @@ class FruitRenderer {
   int fps;
   uint32_t menuButtonAlpha;
   uint32_t menuButtonHover;
+  /// Where the lookahead says the next planet lands, the drop line ends there
+  bool showLanding;
+  bool landingMerges;
+  Point landing;
+  Scalar landingRadius;
   Placement menuButtonPlacement;
   Timestamp performance;
   uint64_t performanceCounts[16];
@@ -136,7 +255,11 @@ class FruitRenderer {
 
   /// Renders the topmost layer for the game and lost state
   void renderCommonOverlay(PixelBuffer pb);
+  /// Makes room for the fruits of a simulation with this capacity
+  void reserveFruits(int newMaxNumFruits);
   void layoutCommonOverlay();
+  /// Adds the parts of the target that look different from the last frame
+  void findDamage();
   void addTime();
 public:
   FruitRenderer(SDL_Surface *target);
@@ -160,18 +283,49 @@ public:
     menuButtonHover = alpha < 0 ? 0 : alpha > 255 ? 255 : alpha;
   }
 
+  /// A drop setting off merges gets a brighter line
+  inline void setLanding(const Point &pos, Scalar radius, bool merges) {
+    showLanding = true;
+    landing = pos;
+    landingRadius = radius;
+    landingMerges = merges;
+  }
+
+  inline void clearLanding() {
+    showLanding = false;
+  }
+
   inline void setLayout(Scalar newZoom, Scalar newOffsetX, const FruitSim &sim) {
     zoom = newZoom;
     offsetX = newOffsetX;
     sizeX = sim.getWorldWidth();
     sizeY = sim.getWorldHeight();
     layoutCommonOverlay();
+    invalidate();
+  }
+
+  /// The next renderFruits draws all of the target, anything else may
+  /// have drawn over it
+  inline void invalidate() {
+    invalidated = true;
+  }
+
+  /// Only possible when the platform keeps the last frame on the screen
+  inline void setCompositing(bool enabled) {
+    compositing = enabled;
+    invalidate();
+  }
+
+  inline const Damage& getDamage() const {
+    return damage;
   }
   SDL_Surface* renderText(const char *str, uint32_t color);
   void renderTitle(int taglineSelection, int fade);
   void renderLostScreen(int score, int highscore, SDL_Surface *background, int animationFrame);
   void renderMenuScores(int score, int highscore);
+  /// Also keeps the background, renderFruits starts the frames with it
   void renderBackground(SDL_Surface *background);
   void renderSelection(PixelBuffer pb, int left, int top, int right, int bottom, int shift, bool hollow = false);
-  void renderFruits(FruitSim &sim, int count, int selection, int outlierIndex, uint32_t frameIndex, Scalar frameFraction, bool skipScore);
+  /// outlierId is the id of the fruit sticking out of the world, or -1
+  void renderFruits(FruitSim &sim, int count, int selection, int outlierId, uint32_t frameIndex, Scalar frameFraction, bool skipScore);
 };
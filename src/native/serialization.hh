@@ -40,7 +40,9 @@ struct SaveState {
 
   uint32_t audioFlagsMuted;
   NextDrop next;
-  int32_t outlierIndex;
+  /// Older saves have the index, but loading gives the fruits ids
+  /// matching their indices, see FruitSimT::setNumFruits
+  int32_t outlierId;
   uint32_t simulationFrame;
   int32_t score;
   uint32_t numHighscores;
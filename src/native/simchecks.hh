@@ -0,0 +1,222 @@
+#pragma once
+
+// Checks of the simulation that have a right answer, each one returns
+// whether it passed. The speed test of the game prints them, simbench
+// runs them with its check scenario and fails if any of them fails.
+
+#include <string.h>
+
+#include "util.hh"
+#include "../common/sim.hh"
+
+namespace simcheck {
+  const float gameGravity = 0.0078125f * 0.5f;
+
+  /// A simulation of the world and gravity of the game, the caller deletes it
+  template <typename S> FruitSimT<S>* newGameSim(int capacity = defaultFruitCap) {
+    FruitSimT<S> *sim = new FruitSimT<S>(capacity);
+    sim->init(7);
+    sim->setGravity(S(gameGravity));
+    return sim;
+  }
+
+  /// Builds a checkerboard pile of the two smallest planets, so
+  /// no two planets of the same kind touch each other at the start
+  template <typename S> void buildPile(FruitSimT<S> &sim, int count) {
+    sim.newGame();
+    S r = sim.getRadius(1);
+    S spacing = sim.getRadius(0) + r;
+    int columns = scalarFloor((sim.getWorldWidth() - r * 2) / spacing) + 1;
+    for (int i = 0; i < count; ++i) {
+      int row = i / columns;
+      int column = i % columns;
+      S x = spacing * column + r;
+      S y = sim.getWorldHeight() - r - spacing * row;
+      sim.addFruit(x, y, (row + column) & 1, i);
+    }
+  }
+
+  /// Drops random planets like a game would, so there are merges too
+  /// Returns the total number of solver iterations
+  template <typename S> uint64_t playDrops(FruitSimT<S> &sim, int numDrops) {
+    Random rand(11);
+    sim.newGame();
+    uint32_t frame = 0;
+    uint64_t iterations = 0;
+    for (int i = 0; i < numDrops; ++i) {
+      S x = sim.getWorldWidth() * S(rand.fraction());
+      sim.addFruit(x, S(0), rand(sim.getNumRandomRadii()), i);
+      for (int j = 0; j < 24; ++j) {
+        ++frame;
+        sim.simulate(frame, frame);
+        iterations += sim.getLastIterations();
+      }
+    }
+    return iterations;
+  }
+
+  /// The same planets, bit for bit, and the same score
+  template <typename S> bool sameOutcome(FruitSimT<S> &a, FruitSimT<S> &b) {
+    return a.getNumFruits() == b.getNumFruits() && a.getScore() == b.getScore() &&
+        !memcmp(a.getFruits(), b.getFruits(), sizeof(FruitT<S>) * a.getNumFruits());
+  }
+
+  /// Reorders the fruits after every step of a game, the ids must stay
+  /// unique and follow the fruits: a fruit awake all along that didn't
+  /// merge starts its step where the fruit with its id ended the last one
+  template <typename S> bool idsFollowFruits() {
+    AutoDelete<FruitSimT<S>> sim = newGameSim<S>();
+    sim->setReorderInterval(1);
+    sim->newGame();
+    Random rand(3);
+    FruitT<S> last[defaultFruitCap];
+    int numChecked = 0;
+    for (uint32_t frame = 1; frame <= 400 * 24; ++frame) {
+      if (frame % 24 == 0) {
+        S x = sim->getWorldWidth() * S(rand.fraction());
+        sim->addFruit(x, S(0), rand(sim->getNumRandomRadii()), frame);
+      }
+      const FruitT<S> *fruits = sim->getFruits();
+      for (int i = 0; i < sim->getNumFruits(); ++i) {
+        last[fruits[i].id()] = fruits[i];
+      }
+      sim->simulate(frame, frame);
+      bool seen[defaultFruitCap] = { };
+      for (int i = 0; i < sim->getNumFruits(); ++i) {
+        const FruitT<S> &f(fruits[i]);
+        const FruitT<S> &before(last[f.id()]);
+        if (seen[f.id()]) return false;
+        seen[f.id()] = true;
+        if ((f.flags | before.flags) & FruitFlags::asleep || f.rIndex != before.rIndex) continue;
+        if (f.lastPos.x != before.pos.x || f.lastPos.y != before.pos.y) return false;
+        ++numChecked;
+      }
+    }
+    return numChecked > 0;
+  }
+
+  /// The vectorized overlap test must not change the outcome in any bit
+  template <typename S> bool contactKernelMatches(bool broadphase) {
+    AutoDelete<FruitSimT<S>> vector = newGameSim<S>();
+    AutoDelete<FruitSimT<S>> scalar = newGameSim<S>();
+    FruitSimT<S> *sims[] = { vector, scalar };
+    for (int i = 0; i < 2; ++i) {
+      sims[i]->setBroadphaseEnabled(broadphase);
+      sims[i]->setContactKernelEnabled(i == 0);
+      playDrops(*sims[i], 400);
+    }
+    return sameOutcome<S>(*vector, *scalar);
+  }
+
+  /// Planets far apart in a wide world must not touch, the squared
+  /// distance of such a pair doesn't fit in fixed point
+  template <typename S> bool farPlanetsStayApart() {
+    AutoDelete<FruitSimT<S>> sim = newGameSim<S>();
+    sim->setWorldSize(S(maxWorldSize), S(16));
+    sim->setBroadphaseEnabled(false);
+    sim->setSleepingEnabled(false);
+    sim->newGame();
+    const int numPlanets = 11;
+    for (int i = 0; i < numPlanets; ++i) {
+      sim->addFruit(S(10 + 22 * i), sim->getWorldHeight(), 0, i);
+    }
+    for (uint32_t frame = 1; frame <= 64; ++frame) {
+      sim->simulate(frame, frame);
+    }
+    const FruitT<S> *fruits = sim->getFruits();
+    for (int i = 0; i < numPlanets; ++i) {
+      if (fruits[i].pos.x != S(10 + 22 * i)) return false;
+    }
+    return sim->getNumFruits() == numPlanets;
+  }
+
+  /// A settled pile in a world made narrower must end up inside it,
+  /// the sleepers outside included
+  template <typename S> bool shrunkWorldPushesIn() {
+    AutoDelete<FruitSimT<S>> sim = newGameSim<S>();
+    sim->setWorldSize(S(24), S(16));
+    playDrops(*sim, 40);
+    // playDrops took 24 steps for each drop
+    for (uint32_t frame = 40 * 24 + 1; frame <= 40 * 24 + 600; ++frame) {
+      sim->simulate(frame, frame);
+    }
+    sim->setWorldSize(S(12), S(16));
+    for (uint32_t frame = 40 * 24 + 601; frame <= 40 * 24 + 1200; ++frame) {
+      sim->simulate(frame, frame);
+    }
+    const FruitT<S> *fruits = sim->getFruits();
+    S slack(0.25f);
+    for (int i = 0; i < sim->getNumFruits(); ++i) {
+      const FruitT<S> &f(fruits[i]);
+      if (f.pos.x < f.r - slack || f.pos.x > sim->getWorldWidth() - f.r + slack) return false;
+    }
+    return true;
+  }
+
+  /// A warm started game of 100 drops with the solver settings of the game
+  template <typename S> FruitSimT<S>* newSnapshotSim() {
+    FruitSimT<S> *sim = newGameSim<S>();
+    sim->setSolverIterations(4, 24);
+    sim->setPenetrationTolerance(S(0.05f));
+    sim->setWarmStartingEnabled(true);
+    playDrops(*sim, 100);
+    return sim;
+  }
+
+  /// Plays on from the last step of playDrops and keeps what it ended with
+  template <typename S> struct Outcome {
+    FruitT<S> fruits[defaultFruitCap];
+    int numFruits;
+    int score;
+
+    void play(FruitSimT<S> &sim, uint32_t frame) {
+      for (int i = 1; i <= 256; ++i) {
+        sim.simulate(frame + i, frame + i);
+      }
+      numFruits = sim.getNumFruits();
+      score = sim.getScore();
+      memcpy(fruits, sim.getFruits(), sizeof(FruitT<S>) * numFruits);
+    }
+
+    bool operator==(const Outcome &other) const {
+      return numFruits == other.numFruits && score == other.score &&
+          !memcmp(fruits, other.fruits, sizeof(FruitT<S>) * numFruits);
+    }
+  };
+
+  /// The steps after restoring a snapshot have to be the ones after
+  /// saving it, in the same simulation and in a new one
+  template <typename S> bool snapshotsRepeat() {
+    AutoDelete<FruitSimT<S>> sim = newSnapshotSim<S>();
+    AutoDelete<FruitSimT<S>> other = new FruitSimT<S>(64);
+    // newSnapshotSim took 24 steps for each drop
+    uint32_t frame = 100 * 24;
+    FruitSnapshotT<S> snapshot;
+    sim->saveSnapshot(snapshot);
+    AutoDelete<Outcome<S>> saved = new Outcome<S>();
+    AutoDelete<Outcome<S>> restored = new Outcome<S>();
+    saved->play(*sim, frame);
+    sim->restoreSnapshot(snapshot);
+    restored->play(*sim, frame);
+    bool repeat = *saved == *restored;
+    other->restoreSnapshot(snapshot);
+    restored->play(*other, frame);
+    return repeat && *saved == *restored;
+  }
+
+  /// The same number of threads has to give the same outcome every time
+  template <typename S> bool solverThreadsRepeat(SolverJobs *jobs) {
+    AutoDelete<FruitSimT<S>> first = newGameSim<S>();
+    AutoDelete<FruitSimT<S>> second = newGameSim<S>();
+    FruitSimT<S> *sims[] = { first, second };
+    for (int i = 0; i < 2; ++i) {
+      sims[i]->setSolverJobs(jobs);
+      // a big pile, so the grid is split into bands
+      buildPile(*sims[i], 1024);
+      for (int j = 1; j <= 256; ++j) {
+        sims[i]->simulate(j, j);
+      }
+    }
+    return sameOutcome<S>(*first, *second);
+  }
+}
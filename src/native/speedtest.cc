@@ -0,0 +1,364 @@
+#include "speedtest.hh"
+
+#ifdef SPEEDTESTING
+
+#include <iostream>
+#include <sched.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "../common/sim.hh"
+#include "util.hh"
+#include "lookahead.hh"
+#include "renderer.hh"
+#include "sphere_kernel.hh"
+#include "simchecks.hh"
+#ifdef MULTICORE
+#include "workers.hh"
+#endif
+
+namespace {
+  const int numSteps = 16;
+
+  /// Counts the L1 data cache read misses of the calling thread,
+  /// if the platform and the kernel settings allow it
+  class CacheMissCounter {
+    int fd;
+  public:
+    CacheMissCounter(): fd(-1) {
+#ifdef __linux__
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D |
+          (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~CacheMissCounter() {
+#ifdef __linux__
+      if (fd >= 0) close(fd);
+#endif
+    }
+
+    inline bool isAvailable() const {
+      return fd >= 0;
+    }
+
+    void start() {
+#ifdef __linux__
+      if (fd < 0) return;
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    uint64_t stop() {
+      uint64_t count = 0;
+#ifdef __linux__
+      if (fd < 0) return 0;
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+      return count;
+    }
+  };
+
+  struct StepCost {
+    uint64_t micros;
+    uint64_t cacheMisses;
+  };
+
+  StepCost measureSteps(FruitSim &sim, int count, CacheMissCounter *misses = nullptr) {
+    simcheck::buildPile(sim, count);
+    if (misses) misses->start();
+    Timestamp start;
+    for (int i = 1; i <= numSteps; ++i) {
+      sim.simulate(i, i);
+    }
+    StepCost cost;
+    cost.micros = start.elapsedMicros() / numSteps;
+    cost.cacheMisses = misses ? misses->stop() / numSteps : 0;
+    return cost;
+  }
+
+  void printGame(const char *name, FruitSim &sim, int numDrops) {
+    Timestamp start;
+    uint64_t iterations = simcheck::playDrops(sim, numDrops);
+    uint64_t micros = start.elapsedMicros();
+    std::cout << name << " " << micros / 1000 << " ms (" <<
+        static_cast<float>(iterations) / (numDrops * 24) << " iterations/step)";
+  }
+
+  /// Lets the pile of a game come to rest, then measures the steps
+  uint64_t measureSettledSteps(FruitSim &sim, int numDrops) {
+    simcheck::playDrops(sim, numDrops);
+    uint32_t frame = numDrops * 24;
+    for (int i = 0; i < 1024; ++i) {
+      ++frame;
+      sim.simulate(frame, frame);
+    }
+    Timestamp start;
+    for (int i = 0; i < numSteps; ++i) {
+      ++frame;
+      sim.simulate(frame, frame);
+    }
+    return start.elapsedMicros() / numSteps;
+  }
+
+  /// Steps a dense pile in a world of the given size
+  uint64_t measureLargeWorld(int width, int height, int count) {
+    AutoDelete<FruitSim> sim = simcheck::newGameSim<Scalar>(count);
+    sim->setWorldSize(Scalar(width), Scalar(height));
+    return measureSteps(*sim, count).micros;
+  }
+
+  /// Returns the microseconds saving the snapshot of a game takes
+  uint64_t measureSnapshotSave() {
+    AutoDelete<FruitSim> sim = simcheck::newSnapshotSim<Scalar>();
+    FruitSnapshot snapshot;
+    const int numSaves = 256;
+    Timestamp start;
+    for (int i = 0; i < numSaves; ++i) {
+      sim->saveSnapshot(snapshot);
+    }
+    return start.elapsedMicros() / numSaves;
+  }
+
+  /// The lookahead thread has to land the planet where the game does
+  /// when it drops it there. Returns the microseconds the thread took.
+  uint64_t lookaheadLands(bool &lands) {
+    AutoDelete<FruitSim> sim = simcheck::newGameSim<Scalar>();
+    const int numDrops = 100;
+    simcheck::playDrops(*sim, numDrops);
+    uint32_t frame = numDrops * 24 + 1;
+    Scalar x = sim->getWorldWidth() / 3;
+    DropLookahead lookahead(240);
+    Timestamp start;
+    lookahead.request(*sim, x, 2, 5, frame);
+    DropPrediction predicted;
+    while (!lookahead.getPrediction(predicted)) {
+      sched_yield();
+    }
+    uint64_t micros = start.elapsedMicros();
+    DropPrediction played;
+    sim->predictDrop(x, Scalar(-1.0f), 2, 5, frame, 240, played);
+    lands = predicted.landed && played.landed && predicted.numSteps == played.numSteps &&
+        predicted.landing.x == played.landing.x && predicted.landing.y == played.landing.y &&
+        predicted.chainLength == played.chainLength && predicted.score == played.score;
+    return micros;
+  }
+
+  void printLayout(const char *name, const StepCost &cost, bool withMisses) {
+    std::cout << name << " " << cost.micros << " micros/step";
+    if (withMisses) {
+      std::cout << " (" << cost.cacheMisses << " L1D read misses/step)";
+    }
+  }
+}
+
+void compareSphereKernels() {
+  const int maxRadius = 96;
+  const int numAngles = 64;
+  ShadedSphere::initTables();
+  AutoDeleteArray<uint32_t> albedoPixels = new uint32_t[TEXTURE_SIZE*TEXTURE_SIZE];
+  AutoDeleteArray<uint32_t> shading = new uint32_t[TEXTURE_SIZE*TEXTURE_SIZE];
+  AutoDeleteArray<uint16_t> spans = new uint16_t[TEXTURE_SIZE*2];
+  Random rand(3);
+  for (int i = 0; i < TEXTURE_SIZE*TEXTURE_SIZE; ++i) {
+    albedoPixels[i] = static_cast<uint32_t>(rand() >> 16);
+  }
+  PixelBuffer lightmap(TEXTURE_SIZE, TEXTURE_SIZE, TEXTURE_SIZE, shading);
+  renderSphereLightmap(lightmap);
+  ShadedSphere::findSpans(lightmap, spans);
+  ShadedSphere sphere;
+  sphere.albedo = PixelBuffer(TEXTURE_SIZE, TEXTURE_SIZE, TEXTURE_SIZE, albedoPixels);
+  sphere.shading = shading;
+  sphere.shadingSpans = spans;
+  const int size = maxRadius * 2 + 1;
+  AutoDeleteArray<uint32_t> expected = new uint32_t[size*size];
+  AutoDeleteArray<uint32_t> actual = new uint32_t[size*size];
+  bool matches = true;
+  uint64_t referenceNanos = 0;
+  uint64_t kernelNanos = 0;
+  for (int radius = 1; radius <= maxRadius; ++radius) {
+    int pitch = radius * 2 + 1;
+    PixelBuffer expectedBuffer(pitch, pitch, pitch, expected);
+    PixelBuffer actualBuffer(pitch, pitch, pitch, actual);
+    for (int a = 0; a < numAngles; ++a) {
+      // not a divisor of the full turn, so the angles aren't all round
+      int angle = a * 1031;
+      Timestamp start;
+      sphere.renderReference(expectedBuffer, radius, radius, radius, angle);
+      referenceNanos += start.elapsedNanos(true);
+      sphere.render(actualBuffer, radius, radius, radius, angle);
+      kernelNanos += start.elapsedNanos();
+      if (memcmp(expected, actual, sizeof(uint32_t) * pitch * pitch)) matches = false;
+    }
+  }
+  std::cout << "Sphere kernel " << sphere::kernelName << ": " <<
+      (matches ? "the same pixels as the reference" : "DIFFERENT PIXELS from the reference") <<
+      ", reference " << referenceNanos / 1000 << " micros, kernel " << kernelNanos / 1000 <<
+      " micros for " << maxRadius * numAngles << " spheres" << std::endl;
+  // the edges of the sprites, a few vectors long and the rest
+  const int maxBlend = 19;
+  uint32_t source[maxBlend];
+  uint32_t expectedBlend[maxBlend];
+  uint32_t actualBlend[maxBlend];
+  bool blendMatches = true;
+  for (int round = 0; round < 64; ++round) {
+    for (int count = 1; count <= maxBlend; ++count) {
+      for (int i = 0; i < count; ++i) {
+        uint32_t col = static_cast<uint32_t>(rand() >> 16);
+        uint32_t alpha = col >> 24;
+        source[i] = ablend(col, alpha) & 0xffffffu | alpha << 24;
+        expectedBlend[i] = actualBlend[i] = static_cast<uint32_t>(rand() >> 16);
+      }
+      sphere::blendPixels(expectedBlend, source, count);
+      sphere::blendSpan(actualBlend, source, count);
+      if (memcmp(expectedBlend, actualBlend, sizeof(uint32_t) * count)) blendMatches = false;
+    }
+  }
+  std::cout << "Sprite edge blend " << sphere::kernelName << ": " <<
+      (blendMatches ? "the same pixels as the scalar one" : "DIFFERENT PIXELS from the scalar one") <<
+      std::endl;
+}
+
+void compareSimSpeeds() {
+  const int counts[] = { 128, 512, 1024 };
+  AutoDelete<FruitSim> sim = simcheck::newGameSim<Scalar>();
+  for (int i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+    int count = counts[i];
+    sim->setBroadphaseEnabled(false);
+    uint64_t allPairs = measureSteps(*sim, count).micros;
+    sim->setBroadphaseEnabled(true);
+    uint64_t grid = measureSteps(*sim, count).micros;
+    std::cout << "Broadphase with " << count << " planets: all pairs " <<
+        allPairs << " micros/step, grid " << grid << " micros/step, speedup " <<
+        (grid ? static_cast<float>(allPairs) / grid : 0.0f) << "x" << std::endl;
+  }
+  CacheMissCounter misses;
+  if (!misses.isAvailable()) {
+    std::cout << "Cache miss counters are not available" << std::endl;
+  }
+  for (int i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+    int count = counts[i];
+    sim->setSolverLayout(FruitLayout::arrayOfStructs);
+    StepCost records = measureSteps(*sim, count, &misses);
+    sim->setSolverLayout(FruitLayout::structOfArrays);
+    StepCost arrays = measureSteps(*sim, count, &misses);
+    std::cout << "Solver layout with " << count << " planets: ";
+    printLayout("records", records, misses.isAvailable());
+    std::cout << ", ";
+    printLayout("arrays", arrays, misses.isAvailable());
+    std::cout << std::endl;
+  }
+  sim->setSolverLayout(FruitLayout::structOfArrays);
+  bool matches = simcheck::contactKernelMatches<Scalar>(true) && simcheck::contactKernelMatches<Scalar>(false);
+  std::cout << "Contact kernel " << FruitSim::getContactKernelName() << ": " <<
+      (matches ? "bit-exact with the scalar path" : "MISMATCH with the scalar path") << std::endl;
+  for (int i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+    int count = counts[i];
+    sim->setContactKernelEnabled(false);
+    uint64_t scalar = measureSteps(*sim, count).micros;
+    sim->setContactKernelEnabled(true);
+    uint64_t vector = measureSteps(*sim, count).micros;
+    std::cout << "Contact kernel with " << count << " planets: scalar " <<
+        scalar << " micros/step, vector " << vector << " micros/step" << std::endl;
+  }
+  const int drops[] = { 100, 400 };
+  for (int i = 0; i < sizeof(drops) / sizeof(*drops); ++i) {
+    sim->setSleepingEnabled(false);
+    uint64_t awake = measureSettledSteps(*sim, drops[i]);
+    sim->setSleepingEnabled(true);
+    uint64_t sleeping = measureSettledSteps(*sim, drops[i]);
+    std::cout << "Settled pile after " << drops[i] << " drops: all awake " <<
+        awake << " micros/step, sleeping " << sleeping << " micros/step (" <<
+        sim->getNumAwake() << " of " << sim->getNumFruits() << " awake)" << std::endl;
+  }
+  for (int i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+    int count = counts[i];
+    const int numQueries = 4096;
+    simcheck::buildPile(*sim, count);
+    sim->simulate(1, 1);
+    Random rand(5);
+    Timestamp start;
+    for (int q = 0; q < numQueries; ++q) {
+      Scalar x = sim->getWorldWidth() * Scalar(rand.fraction());
+      Fruit *preview = sim->previewFruit(x, -1.0f, rand(sim->getNumRandomRadii()), q);
+      if (preview) sim->touchesAny(*preview);
+    }
+    uint64_t previewNanos = start.elapsedNanos(true) / numQueries;
+    for (int q = 0; q < numQueries; ++q) {
+      sim->findGroundedOutside(1);
+    }
+    uint64_t groundedNanos = start.elapsedNanos() / numQueries;
+    std::cout << "Queries with " << count << " planets: preview " << previewNanos <<
+        " ns, grounded outside " << groundedNanos << " ns" << std::endl;
+  }
+  sim->setReorderInterval(0);
+  Timestamp orderStart;
+  simcheck::playDrops(*sim, 400);
+  uint64_t addedOrder = orderStart.elapsedMicros(true);
+  sim->setReorderInterval(64);
+  simcheck::playDrops(*sim, 400);
+  uint64_t zOrder = orderStart.elapsedMicros();
+  std::cout << "Fruit order over a game: as added " << addedOrder / 1000 << " ms, Z order " <<
+      zOrder / 1000 << " ms, the ids " << (simcheck::idsFollowFruits<Scalar>() ? "follow the fruits" : "DON'T FOLLOW the fruits") << std::endl;
+  std::cout << "Large worlds: 48x32 with 4096 planets " << measureLargeWorld(48, 32, 4096) <<
+      " micros/step, 128x96 with 16384 planets " << measureLargeWorld(128, 96, 16384) <<
+      " micros/step, far planets " << (simcheck::farPlanetsStayApart<Scalar>() ? "stay apart" : "TOUCH") <<
+      ", a shrunk world " << (simcheck::shrunkWorldPushesIn<Scalar>() ? "pushes the planets in" : "LEAVES PLANETS OUTSIDE") << std::endl;
+  bool repeat = simcheck::snapshotsRepeat<Scalar>();
+  uint64_t saveMicros = measureSnapshotSave();
+  bool lands;
+  uint64_t lookaheadMicros = lookaheadLands(lands);
+  std::cout << "Snapshots: save " << saveMicros << " micros, the steps after a restore " <<
+      (repeat ? "repeat" : "DON'T REPEAT") << ", lookahead " << lookaheadMicros / 1000 << " ms, " <<
+      (lands ? "lands where the game does" : "DOESN'T LAND where the game does") << std::endl;
+  std::cout << "Solver iterations over a game: ";
+  printGame("fixed", *sim, 400);
+  sim->setSolverIterations(4, 24);
+  sim->setPenetrationTolerance(Scalar(0.05f));
+  std::cout << ", ";
+  printGame("adaptive", *sim, 400);
+  sim->setWarmStartingEnabled(true);
+  std::cout << ", ";
+  printGame("warm started", *sim, 400);
+  sim->setWarmStartingEnabled(false);
+  std::cout << std::endl;
+#ifdef MULTICORE
+  const int threadCounts[] = { 2, 4 };
+  for (int t = 0; t < sizeof(threadCounts) / sizeof(*threadCounts); ++t) {
+    WorkerPool workers(threadCounts[t]);
+    std::cout << "Solver on " << workers.getNumThreads() << " threads (" <<
+        WorkerPool::getNumCores() << " cores): " <<
+        (simcheck::solverThreadsRepeat<Scalar>(&workers) ? "deterministic" : "NOT DETERMINISTIC");
+    for (int i = 0; i < sizeof(counts) / sizeof(*counts); ++i) {
+      int count = counts[i];
+      sim->setSolverJobs(nullptr);
+      uint64_t serial = measureSteps(*sim, count).micros;
+      sim->setSolverJobs(&workers);
+      uint64_t parallel = measureSteps(*sim, count).micros;
+      std::cout << ", " << count << " planets " << serial << " -> " << parallel << " micros/step";
+    }
+    std::cout << std::endl;
+    sim->setSolverJobs(nullptr);
+  }
+#endif
+  sim->newGame();
+}
+
+#endif
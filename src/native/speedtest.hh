@@ -0,0 +1,11 @@
+#pragma once
+
+#ifdef SPEEDTESTING
+/// Runs the simulation headless with different settings and
+/// prints the time each step took
+void compareSimSpeeds();
+/// Renders spheres with the kernel of the platform and the reference,
+/// and prints whether they match and how long they took, then checks
+/// the blending of the sprite edges the same way
+void compareSphereKernels();
+#endif
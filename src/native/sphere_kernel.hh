@@ -0,0 +1,217 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "blend.hh"
+
+// Shades a span of a sphere row: each pixel is an albedo texel scaled by
+// the brightness of a lightmap texel, with the alpha of the lightmap.
+// Also blends the edges of the finished sprites over the screen.
+// The instruction set is picked at compile time, every kernel gives the
+// same pixels as the scalar one.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SPHERE_KERNEL_AVX2
+#endif
+#define SPHERE_KERNEL_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SPHERE_KERNEL_NEON
+#endif
+
+namespace sphere {
+
+#if defined(SPHERE_KERNEL_AVX2)
+  const char * const kernelName = "SSE2, AVX2 gather";
+#elif defined(SPHERE_KERNEL_SSE2)
+  const char * const kernelName = "SSE2";
+#elif defined(SPHERE_KERNEL_NEON)
+  const char * const kernelName = "NEON";
+#else
+  const char * const kernelName = "scalar";
+#endif
+
+  /// The texture coordinates of the pixels of a span, in 16.16 texels,
+  /// the lightmap row is the same for all of them
+  struct Span {
+    int u, v, s;
+    int du, dv, ds;
+  };
+
+  inline uint32_t shade(uint32_t albedo, uint32_t light) {
+    return ablend(albedo, light & 0xff) | (light & 0xff000000u);
+  }
+
+  /// What the target keeps under a pixel of the alpha, out of 256,
+  /// so a transparent pixel leaves the target as it was
+  inline uint32_t keptByAlpha(uint32_t alpha) {
+    uint32_t kept = 0xff - alpha;
+    return kept + (kept >> 7);
+  }
+
+  /// Blends pixels with premultiplied alpha over the target
+  inline void blendPixels(uint32_t *d, const uint32_t *s, int count) {
+    for (int x = 0; x < count; ++x) {
+      d[x] = s[x] + packColor(unpackColor(d[x]) * keptByAlpha(s[x] >> 24) >> 8);
+    }
+  }
+
+  /// The texels of the textures are 1 << bits wide and high
+  template <unsigned bits> inline void shadePixels(uint32_t *d, int count, Span &p,
+      const uint32_t *albedo, const uint32_t *lightRow) {
+    const int mask = (1 << bits) - 1;
+    for (int x = 0; x < count; ++x) {
+      int ru = (p.u >> 16) & mask;
+      int rv = (p.v >> 16) & mask;
+      int rs = (p.s >> 16) & mask;
+      d[x] = shade(albedo[ru + (rv << bits)], lightRow[rs]);
+      p.u += p.du;
+      p.v += p.dv;
+      p.s += p.ds;
+    }
+  }
+
+#if defined(SPHERE_KERNEL_SSE2)
+  /// Four pixels at a time, the texels are fetched one by one
+  /// unless AVX2 can gather them
+  template <unsigned bits> inline void shadeSpan(uint32_t *d, int count, Span &p,
+      const uint32_t *albedo, const uint32_t *lightRow) {
+    const __m128i mask = _mm_set1_epi32((1 << bits) - 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaMask = _mm_set1_epi32(0xff000000u);
+    const __m128i lowByte = _mm_set1_epi32(0xff);
+    // the coordinates of the 4 pixels are the first one plus 0..3 steps
+    __m128i u = _mm_set_epi32(p.u + 3 * p.du, p.u + 2 * p.du, p.u + p.du, p.u);
+    __m128i v = _mm_set_epi32(p.v + 3 * p.dv, p.v + 2 * p.dv, p.v + p.dv, p.v);
+    __m128i s = _mm_set_epi32(p.s + 3 * p.ds, p.s + 2 * p.ds, p.s + p.ds, p.s);
+    const __m128i du = _mm_set1_epi32(4 * p.du);
+    const __m128i dv = _mm_set1_epi32(4 * p.dv);
+    const __m128i ds = _mm_set1_epi32(4 * p.ds);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+      __m128i ru = _mm_and_si128(_mm_srai_epi32(u, 16), mask);
+      __m128i rv = _mm_and_si128(_mm_srai_epi32(v, 16), mask);
+      __m128i rs = _mm_and_si128(_mm_srai_epi32(s, 16), mask);
+      __m128i texel = _mm_add_epi32(ru, _mm_slli_epi32(rv, bits));
+#if defined(SPHERE_KERNEL_AVX2)
+      __m128i col = _mm_i32gather_epi32(reinterpret_cast<const int*>(albedo), texel, 4);
+      __m128i light = _mm_i32gather_epi32(reinterpret_cast<const int*>(lightRow), rs, 4);
+#else
+      alignas(16) int32_t ti[4], si[4];
+      _mm_store_si128(reinterpret_cast<__m128i*>(ti), texel);
+      _mm_store_si128(reinterpret_cast<__m128i*>(si), rs);
+      __m128i col = _mm_set_epi32(albedo[ti[3]], albedo[ti[2]], albedo[ti[1]], albedo[ti[0]]);
+      __m128i light = _mm_set_epi32(lightRow[si[3]], lightRow[si[2]], lightRow[si[1]], lightRow[si[0]]);
+#endif
+      // the brightness in every 16 bit half, then in all four channels of a pixel
+      __m128i b = _mm_and_si128(light, lowByte);
+      b = _mm_or_si128(b, _mm_slli_epi32(b, 16));
+      __m128i bLow = _mm_unpacklo_epi32(b, b);
+      __m128i bHigh = _mm_unpackhi_epi32(b, b);
+      // each channel times the brightness fits in 16 bits, ablend keeps the upper byte
+      __m128i low = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(col, zero), bLow), 8);
+      __m128i high = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(col, zero), bHigh), 8);
+      __m128i shaded = _mm_or_si128(_mm_packus_epi16(low, high), _mm_and_si128(light, alphaMask));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), shaded);
+      u = _mm_add_epi32(u, du);
+      v = _mm_add_epi32(v, dv);
+      s = _mm_add_epi32(s, ds);
+    }
+    p.u += x * p.du;
+    p.v += x * p.dv;
+    p.s += x * p.ds;
+    shadePixels<bits>(d + x, count - x, p, albedo, lightRow);
+  }
+
+  inline void blendSpan(uint32_t *d, const uint32_t *s, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lowByte = _mm_set1_epi32(0xff);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+      __m128i src = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x));
+      __m128i dst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + x));
+      // what the target keeps in every 16 bit half, then in all four channels of a pixel
+      __m128i t = _mm_xor_si128(_mm_srli_epi32(src, 24), lowByte);
+      t = _mm_add_epi32(t, _mm_srli_epi32(t, 7));
+      t = _mm_or_si128(t, _mm_slli_epi32(t, 16));
+      __m128i tLow = _mm_unpacklo_epi32(t, t);
+      __m128i tHigh = _mm_unpackhi_epi32(t, t);
+      __m128i low = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(dst, zero), tLow), 8);
+      __m128i high = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(dst, zero), tHigh), 8);
+      // the channels can't overflow, the source is premultiplied
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), _mm_add_epi32(_mm_packus_epi16(low, high), src));
+    }
+    blendPixels(d + x, s + x, count - x);
+  }
+#elif defined(SPHERE_KERNEL_NEON)
+  /// Four pixels at a time, the texels are fetched one by one
+  template <unsigned bits> inline void shadeSpan(uint32_t *d, int count, Span &p,
+      const uint32_t *albedo, const uint32_t *lightRow) {
+    const uint32x4_t mask = vdupq_n_u32((1 << bits) - 1);
+    const int32x4_t lanes = { 0, 1, 2, 3 };
+    int32x4_t u = vmlaq_n_s32(vdupq_n_s32(p.u), lanes, p.du);
+    int32x4_t v = vmlaq_n_s32(vdupq_n_s32(p.v), lanes, p.dv);
+    int32x4_t s = vmlaq_n_s32(vdupq_n_s32(p.s), lanes, p.ds);
+    const int32x4_t du = vdupq_n_s32(4 * p.du);
+    const int32x4_t dv = vdupq_n_s32(4 * p.dv);
+    const int32x4_t ds = vdupq_n_s32(4 * p.ds);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+      uint32x4_t ru = vandq_u32(vreinterpretq_u32_s32(vshrq_n_s32(u, 16)), mask);
+      uint32x4_t rv = vandq_u32(vreinterpretq_u32_s32(vshrq_n_s32(v, 16)), mask);
+      uint32x4_t rs = vandq_u32(vreinterpretq_u32_s32(vshrq_n_s32(s, 16)), mask);
+      uint32x4_t texel = vaddq_u32(ru, vshlq_n_u32(rv, bits));
+      uint32_t ti[4], si[4];
+      vst1q_u32(ti, texel);
+      vst1q_u32(si, rs);
+      uint32_t c[4] = { albedo[ti[0]], albedo[ti[1]], albedo[ti[2]], albedo[ti[3]] };
+      uint32_t l[4] = { lightRow[si[0]], lightRow[si[1]], lightRow[si[2]], lightRow[si[3]] };
+      uint32x4_t col = vld1q_u32(c);
+      uint32x4_t light = vld1q_u32(l);
+      // the brightness in all four bytes of a pixel
+      uint8x16_t b = vreinterpretq_u8_u32(vmulq_n_u32(vandq_u32(light, vdupq_n_u32(0xff)), 0x01010101u));
+      uint8x16_t c8 = vreinterpretq_u8_u32(col);
+      uint8x8_t low = vshrn_n_u16(vmull_u8(vget_low_u8(c8), vget_low_u8(b)), 8);
+      uint8x8_t high = vshrn_n_u16(vmull_u8(vget_high_u8(c8), vget_high_u8(b)), 8);
+      uint32x4_t shaded = vorrq_u32(vreinterpretq_u32_u8(vcombine_u8(low, high)),
+          vandq_u32(light, vdupq_n_u32(0xff000000u)));
+      vst1q_u32(d + x, shaded);
+      u = vaddq_s32(u, du);
+      v = vaddq_s32(v, dv);
+      s = vaddq_s32(s, ds);
+    }
+    p.u += x * p.du;
+    p.v += x * p.dv;
+    p.s += x * p.ds;
+    shadePixels<bits>(d + x, count - x, p, albedo, lightRow);
+  }
+
+  inline void blendSpan(uint32_t *d, const uint32_t *s, int count) {
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+      uint32x4_t src = vld1q_u32(s + x);
+      uint8x16_t dst = vreinterpretq_u8_u32(vld1q_u32(d + x));
+      // what the target keeps in both 16 bit halves, then in all four channels of a pixel
+      uint32x4_t t = veorq_u32(vshrq_n_u32(src, 24), vdupq_n_u32(0xff));
+      t = vmulq_n_u32(vaddq_u32(t, vshrq_n_u32(t, 7)), 0x00010001u);
+      uint32x4x2_t kept = vzipq_u32(t, t);
+      uint8x8_t low = vshrn_n_u16(vmulq_u16(vmovl_u8(vget_low_u8(dst)), vreinterpretq_u16_u32(kept.val[0])), 8);
+      uint8x8_t high = vshrn_n_u16(vmulq_u16(vmovl_u8(vget_high_u8(dst)), vreinterpretq_u16_u32(kept.val[1])), 8);
+      // the channels can't overflow, the source is premultiplied
+      vst1q_u32(d + x, vaddq_u32(vreinterpretq_u32_u8(vcombine_u8(low, high)), src));
+    }
+    blendPixels(d + x, s + x, count - x);
+  }
+#else
+  template <unsigned bits> inline void shadeSpan(uint32_t *d, int count, Span &p,
+      const uint32_t *albedo, const uint32_t *lightRow) {
+    shadePixels<bits>(d, count, p, albedo, lightRow);
+  }
+
+  inline void blendSpan(uint32_t *d, const uint32_t *s, int count) {
+    blendPixels(d, s, count);
+  }
+#endif
+}
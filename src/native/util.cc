@@ -123,6 +123,12 @@ void Condition::notify() {
   pthread_mutex_unlock(&mutex);
 }
 
+void Condition::notifyAll() {
+  pthread_mutex_lock(&mutex);
+  pthread_cond_broadcast(&condition);
+  pthread_mutex_unlock(&mutex);
+}
+
 int createDirectoryForFile(const char *path) {
   size_t len = strnlen(path, 65536);
   char temp[len + 1];
@@ -143,6 +143,16 @@ public:
 
   void wait();
   void notify();
+
+  /// Waits until the predicate holds, it is checked with the lock held,
+  /// so it can't miss a change that is followed by notifyAll
+  template <typename Predicate> void waitUntil(Predicate done) {
+    pthread_mutex_lock(&mutex);
+    while (!done()) pthread_cond_wait(&condition, &mutex);
+    pthread_mutex_unlock(&mutex);
+  }
+  /// Wakes up every waiting thread
+  void notifyAll();
 };
 
 int createDirectoryForFile(const char *path);
@@ -0,0 +1,123 @@
+#include "workers.hh"
+
+#include <sched.h>
+#include <unistd.h>
+
+namespace {
+  /// The next batch usually comes within a few microseconds,
+  /// the threads spin that long before going to sleep
+  const int spinCount = 4096;
+
+  inline int lowestBit(uint32_t bits) {
+    return __builtin_ctz(bits);
+  }
+}
+
+WorkerPool::WorkerPool(int numThreads, bool pinned):
+    numThreads(numThreads < 1 ? 1 : numThreads > maxThreads ? maxThreads : numThreads),
+    job(nullptr),
+    context(nullptr),
+    firstJob(0),
+    claims(0xffffffffu),
+    numRemaining(0),
+    running(true) {
+  int numCores = getNumCores();
+  for (int i = 0; i < this->numThreads - 1; ++i) {
+    Thread &t(threads[i]);
+    t.pool = this;
+    // the calling thread is the first one
+    t.index = i + 1;
+    pthread_create(&t.thread, nullptr, threadMain, &t);
+#ifdef __linux__
+    if (pinned) {
+      cpu_set_t cores;
+      CPU_ZERO(&cores);
+      CPU_SET(t.index % numCores, &cores);
+      pthread_setaffinity_np(t.thread, sizeof(cores), &cores);
+    }
+#endif
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  running = false;
+  started.notifyAll();
+  for (int i = 0; i < numThreads - 1; ++i) {
+    pthread_join(threads[i].thread, nullptr);
+  }
+}
+
+void* WorkerPool::threadMain(void *ptr) {
+  Thread *t = reinterpret_cast<Thread*>(ptr);
+  t->pool->worker(t->index);
+  return nullptr;
+}
+
+void WorkerPool::worker(int index) {
+  uint32_t seen = 0;
+  while (true) {
+    for (int i = 0; i < spinCount && (claims.load(std::memory_order_acquire) >> 32) == seen && running; ++i) { }
+    started.waitUntil([this, seen]() {
+      return (claims.load(std::memory_order_acquire) >> 32) != seen || !running;
+    });
+    if (!running) break;
+    seen = claims.load(std::memory_order_acquire) >> 32;
+    work(seen, index);
+  }
+}
+
+void WorkerPool::work(uint32_t batch, int index) {
+  int first = firstJob.load(std::memory_order_relaxed);
+  uint32_t own = 0;
+  for (int i = (numThreads - first % numThreads + index) % numThreads; i < maxBatchJobs; i += numThreads) {
+    own |= 1u << i;
+  }
+  uint64_t claim = claims.load(std::memory_order_acquire);
+  while ((claim >> 32) == batch) {
+    uint32_t unclaimed = ~static_cast<uint32_t>(claim);
+    if (!unclaimed) break;
+    // its own jobs first, then it helps out the others
+    int i = lowestBit(unclaimed & own ? unclaimed & own : unclaimed);
+    // on failure claim is reloaded and checked again
+    if (!claims.compare_exchange_weak(claim, claim | (1u << i), std::memory_order_acq_rel, std::memory_order_acquire)) continue;
+    job(context, first + i);
+    if (numRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1) finished.notifyAll();
+    claim = claims.load(std::memory_order_acquire);
+  }
+}
+
+void WorkerPool::runBatch(int first, int count) {
+  firstJob.store(first, std::memory_order_relaxed);
+  numRemaining.store(count, std::memory_order_relaxed);
+  // starting the next batch publishes everything above
+  uint32_t batch = (claims.load(std::memory_order_relaxed) >> 32) + 1;
+  uint32_t notJobs = count < maxBatchJobs ? ~((1u << count) - 1) : 0;
+  claims.store(static_cast<uint64_t>(batch) << 32 | notJobs, std::memory_order_release);
+  started.notifyAll();
+  work(batch, 0);
+  for (int i = 0; i < spinCount && numRemaining.load(std::memory_order_acquire); ++i) { }
+  finished.waitUntil([this]() {
+    return numRemaining.load(std::memory_order_acquire) == 0;
+  });
+}
+
+void WorkerPool::run(Job newJob, void *newContext, int numJobs) {
+  if (numJobs <= 0) return;
+  if (numThreads == 1 || numJobs == 1) {
+    for (int i = 0; i < numJobs; ++i) {
+      newJob(newContext, i);
+    }
+    return;
+  }
+  job = newJob;
+  context = newContext;
+  for (int first = 0; first < numJobs; first += maxBatchJobs) {
+    int count = numJobs - first;
+    runBatch(first, count < maxBatchJobs ? count : maxBatchJobs);
+  }
+}
+
+int WorkerPool::getNumCores() {
+  long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+  return numCores < 1 ? 1 : static_cast<int>(numCores);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <pthread.h>
+
+#include "util.hh"
+#include "../common/sim.hh"
+
+/// A fixed set of threads that stay around for the whole game and run
+/// the jobs of the solver. The thread calling run takes jobs as well,
+/// so a pool of n threads starts n - 1 of its own.
+/// Job i goes to thread i % n unless that thread is late, then another
+/// one takes it, so the same jobs mostly end up on the same threads.
+class WorkerPool final: public SolverJobs {
+  static const int maxThreads = 8;
+  /// The jobs of a batch are claimed in a bit mask
+  static const int maxBatchJobs = 32;
+
+  struct Thread {
+    WorkerPool *pool;
+    pthread_t thread;
+    int index;
+  };
+
+  Thread threads[maxThreads - 1];
+  int numThreads;
+  Condition started;
+  Condition finished;
+  Job job;
+  void *context;
+  std::atomic<int> firstJob;
+  /// The batch number in the upper half, a bit for each job in the lower,
+  /// set once it is claimed. The bits beyond the jobs of the batch start
+  /// out set, so a thread late from the previous batch can't claim a job
+  /// of the current one.
+  std::atomic<uint64_t> claims;
+  std::atomic<int> numRemaining;
+  std::atomic<bool> running;
+
+  static void* threadMain(void *ptr);
+  void worker(int index);
+  void work(uint32_t batch, int index);
+  void runBatch(int first, int count);
+public:
+  /// Pinning binds the threads of the pool to separate cores, the calling
+  /// thread is left alone
+  WorkerPool(int numThreads, bool pinned = false);
+  ~WorkerPool();
+
+  void run(Job job, void *context, int numJobs) override;
+
+  int getNumThreads() const override {
+    return numThreads;
+  }
+
+  /// The number of cores online, at least 1
+  static int getNumCores();
+};
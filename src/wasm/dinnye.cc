@@ -104,39 +104,116 @@ extern "C" void reset() {
   allocator.reset();
 }
 
-FruitSim *sim = nullptr;
+namespace {
+  FruitSimT<float> *floatSim = nullptr;
+  FruitSimT<Fixed> *fixedSim = nullptr;
+  bool fixedPoint = false;
+
+  template <typename S> S toScalar(const FruitSimT<S>&, float val) {
+    return S(val);
+  }
+
+  /// Calls the function with the simulation of the chosen kind of math,
+  /// the records it returns are addressed by JS according to isFixedPoint
+  template <typename Call> auto withSim(Call call) {
+    if (fixedPoint) {
+      if (!fixedSim) fixedSim = new FruitSimT<Fixed>();
+      return call(*fixedSim);
+    }
+    if (!floatSim) floatSim = new FruitSimT<float>();
+    return call(*floatSim);
+  }
+}
+
+/// Picks the math of the simulation, call it before init
+extern "C" void setFixedPoint(bool newFixedPoint) {
+  fixedPoint = newFixedPoint;
+}
+
+extern "C" bool isFixedPoint() {
+  return fixedPoint;
+}
+
+/// Call these before init, a new capacity drops the fruits
+extern "C" void setWorldSize(float width, float height) {
+  withSim([=](auto &sim) { sim.setWorldSize(toScalar(sim, width), toScalar(sim, height)); });
+}
+
+extern "C" void setMaxNumFruits(int capacity) {
+  withSim([=](auto &sim) { sim.setMaxNumFruits(capacity); });
+}
 
 extern "C" float getWorldSizeX() {
-  return worldSizeX;
+  return withSim([](auto &sim) { return static_cast<float>(sim.getWorldWidth()); });
 }
 
 extern "C" float getWorldSizeY() {
-  return worldSizeY;
+  return withSim([](auto &sim) { return static_cast<float>(sim.getWorldHeight()); });
+}
+
+extern "C" float getRadius(int index) {
+  return withSim([index](auto &sim) { return static_cast<float>(sim.getRadius(index)); });
 }
 
 extern "C" float getNumFruits() {
-  return sim->getNumFruits();
+  return withSim([](auto &sim) { return sim.getNumFruits(); });
 }
 
 void* operator new(size_t size) {
     return allocator.allocateBytes(size);
 }
 
-extern "C" Fruit* init(int worldSeed) {
-  if (!sim) {
-    sim = new FruitSim();
-  }
-  return sim->init(worldSeed);
+void* operator new[](size_t size) {
+    return allocator.allocateBytes(size);
+}
+
+// the linear allocator only ever frees by releasing a mark
+void operator delete(void *ptr) noexcept { }
+void operator delete(void *ptr, size_t size) noexcept { }
+void operator delete[](void *ptr) noexcept { }
+void operator delete[](void *ptr, size_t size) noexcept { }
+
+extern "C" const void* init(int worldSeed) {
+  return withSim([worldSeed](auto &sim) -> const void* { return sim.init(worldSeed); });
+}
+
+extern "C" void setSolverIterations(int minIterations, int maxIterations, float tolerance) {
+  withSim([=](auto &sim) {
+    sim.setSolverIterations(minIterations, maxIterations);
+    sim.setPenetrationTolerance(toScalar(sim, tolerance));
+  });
+}
+
+extern "C" int getLastIterations() {
+  return withSim([](auto &sim) { return sim.getLastIterations(); });
+}
+
+/// The SimStats of the last step: five 32 bit counters, then the deepest
+/// overlap in the scalar of the simulation
+extern "C" const void* getStats() {
+  return withSim([](auto &sim) -> const void* { return &sim.getStats(); });
+}
+
+extern "C" const void* simulate(int frameSeed, uint32_t frame) {
+  return withSim([=](auto &sim) -> const void* { return sim.simulate(frameSeed, frame); });
+}
+
+extern "C" int getNumMergeEvents() {
+  return withSim([](auto &sim) { return sim.getNumMergeEvents(); });
 }
 
-extern "C" Fruit* simulate(int frameSeed, uint32_t frame) {
-  return sim->simulate(frameSeed, frame);
+extern "C" const void* getMergeEvents() {
+  return withSim([](auto &sim) -> const void* { return sim.getMergeEvents(); });
 }
 
 extern "C" bool addFruit(float x, float y, unsigned radiusIndex, int seed) {
-  return sim->addFruit(x, y, radiusIndex, seed);
+  return withSim([=](auto &sim) {
+    return sim.addFruit(toScalar(sim, x), toScalar(sim, y), radiusIndex, seed);
+  });
 }
 
-extern "C" Fruit* previewFruit(float x, float y, unsigned radiusIndex, int seed) {
-  return sim->previewFruit(x, y, radiusIndex, seed);
+extern "C" const void* previewFruit(float x, float y, unsigned radiusIndex, int seed) {
+  return withSim([=](auto &sim) -> const void* {
+    return sim.previewFruit(toScalar(sim, x), toScalar(sim, y), radiusIndex, seed);
+  });
 }
@@ -36,6 +36,16 @@ async function startSimulation() {
   }});
   const instance = instanceAndModule.instance;
   memory = instance.exports.memory;
+  // ?fixed in the address runs the 16.16 fixed point simulation
+  const params = new URLSearchParams(location.search);
+  instance.exports.setFixedPoint(params.has("fixed"));
+  const fixedPoint = instance.exports.isFixedPoint();
+  // ?world=64x48 gives a larger world, ?cap=8192 room for more planets
+  if (params.has("cap")) instance.exports.setMaxNumFruits(Number(params.get("cap")));
+  if (params.has("world")) {
+    const [width, height] = params.get("world").split("x").map(Number);
+    instance.exports.setWorldSize(width, height);
+  }
   const init = instance.exports.init;
   const simulate = instance.exports.simulate;
   const addFruit = instance.exports.addFruit;
@@ -43,6 +53,8 @@ async function startSimulation() {
   const worldSizeX = instance.exports.getWorldSizeX();
   const worldSizeY = instance.exports.getWorldSizeY();
   const scale = 720/Math.max(worldSizeX, worldSizeY);
+  // the records hold the scalars as raw 16.16 values in fixed point mode
+  const recordScale = fixedPoint ? scale / 65536 : scale;
   const getNumFruits = instance.exports.getNumFruits;
   const newSeed = () => Math.random()*Number.MAX_SAFE_INTEGER|0;
 
@@ -62,7 +74,9 @@ async function startSimulation() {
         ? previewFruitAddress + (numFloatsPerFruit << 2) - addr
         : numFloats * 4;
     let dv = new DataView(memory.buffer, addr, addressedBytes);
-    let floats = new Float32Array(memory.buffer, addr, addressedBytes >> 2);
+    let floats = fixedPoint
+        ? new Int32Array(memory.buffer, addr, addressedBytes >> 2)
+        : new Float32Array(memory.buffer, addr, addressedBytes >> 2);
     ctx.clearRect(0, 0, ctx.canvas.width, ctx.canvas.height);
     ctx.textAlign = "center";
     ctx.textBaseline = "middle";
@@ -71,13 +85,13 @@ async function startSimulation() {
       let rotation = dv.getUint32(offset*4 + 6*4, true) & 65535;
       ctx.strokeStyle = `hsl(${sizeIndex*30}deg 100% 50%)`;
       ctx.fillStyle = `hsl(${sizeIndex*30}deg 100% 50%)`;
-      const x = floats[offset]*scale;
-      const y = floats[offset + 1]*scale;
-      const dx = x-floats[offset + 2]*scale;
-      const dy = y-floats[offset + 3]*scale;
-      const rsx = floats[offset + 8]*scale;
-      const rsy = floats[offset + 9]*scale;
-      const radius = floats[offset + 4]*scale;
+      const x = floats[offset]*recordScale;
+      const y = floats[offset + 1]*recordScale;
+      const dx = x-floats[offset + 2]*recordScale;
+      const dy = y-floats[offset + 3]*recordScale;
+      const rsx = floats[offset + 8]*recordScale;
+      const rsy = floats[offset + 9]*recordScale;
+      const radius = floats[offset + 4]*recordScale;
       const fontSize = sizeIndex > 1 ? sizeIndex * 2 + 10 : 0;
       ctx.save();
       ctx.translate(x, y);
@@ -104,13 +118,25 @@ async function startSimulation() {
 
   let frameCounter = 0;
   let frame;
+  // ?stats logs what the solver did in every 60th step
+  const logStats = params.has("stats");
+  const getStats = instance.exports.getStats;
   frame = () => {
     drawFruits(simulate(newSeed(), ++frameCounter));
+    if (logStats && frameCounter % 60 == 0) {
+      const address = getStats();
+      const counts = new Uint32Array(memory.buffer, address, 5);
+      const deepest = fixedPoint
+          ? new Int32Array(memory.buffer, address + 20, 1)[0] / 65536
+          : new Float32Array(memory.buffer, address + 20, 1)[0];
+      console.log(`pairs tested ${counts[0]}, overlapping ${counts[1]}, merges ${counts[2]}, ` +
+          `iterations ${counts[3]}, clamped ${counts[4]}, deepest ${deepest}`);
+    }
     requestAnimationFrame(frame);
   };
 
   drawFruits(init(newSeed()));
-  console.log(new Float32Array(memory.buffer, instance.exports.radii.value, 11));
+  console.log(Array.from({ length: 11 }, (_, i) => instance.exports.getRadius(i)));
   frame();
   
   canvas.addEventListener("click", e => {